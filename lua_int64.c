@@ -40,6 +40,36 @@ source:https://github.com/idning/lua-int64.git
 
 static const char int64_type_name[] = "int64";
 
+#ifdef PLLUA_FFI
+/* registry keys of the FFI helpers */
+static const char int64_ffi_box[] = "int64_ffi_box";
+static const char int64_ffi_unbox[] = "int64_ffi_unbox";
+static const char int64_ffi_toarray[] = "int64_ffi_toarray";
+static const char int64_ffi_arraylen[] = "int64_ffi_arraylen";
+
+/* run once per state with the ffi module as argument; the module itself is
+ * not made visible to pllua code. Values are passed by lightuserdata
+ * pointer, so no precision is lost on the way. */
+static const char int64_ffi_chunk[] =
+    "local ffi = ...\n"
+    "local cast, copy, istype, sizeof, typeof =\n"
+    "  ffi.cast, ffi.copy, ffi.istype, ffi.sizeof, ffi.typeof\n"
+    "local int64_p = typeof('int64_t *')\n"
+    "local vla = setmetatable({}, {__index = function(t, ct)\n"
+    "  local v = typeof(ct .. '[?]'); t[ct] = v; return v end})\n"
+    "return function(p) return cast(int64_p, p)[0] end,\n"
+    "  function(p, v) cast(int64_p, p)[0] = v end,\n"
+    "  function(ct, p, n) local a = vla[ct](n)\n"
+    "    copy(a, p, n * sizeof(ct)); return a end,\n"
+    "  function(ct, v) if istype(vla[ct], v) then\n"
+    "    return sizeof(v) / sizeof(ct) end end\n";
+
+static void push_ffi(lua_State *L, const char *key) {
+    lua_pushlightuserdata(L, (void *) key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+}
+#endif
+
 static int64_t check_int64(lua_State* L, int idx) {\
     int64_t* p;
     luaL_checktype(L,idx,LUA_TUSERDATA);
@@ -62,7 +92,11 @@ get_int64(lua_State *L, int index) {
 
     switch(type) {
     case LUA_TNUMBER: {
-        return (int64_t)(luaL_checknumber(L,index));
+#if LUA_VERSION_NUM >= 503
+        if (lua_isinteger(L, index)) /* exact, no trip through double */
+            return (int64_t)lua_tointeger(L, index);
+#endif
+        return (int64_t)lua_tonumber(L, index);
     }
     case LUA_TSTRING: {
 
@@ -75,6 +109,16 @@ get_int64(lua_State *L, int index) {
     case LUA_TUSERDATA:
         value = check_int64(L, index);
         break;
+#ifdef PLLUA_FFI
+    case LUA_TCDATA:
+        if (index < 0)
+            index = lua_gettop(L) + index + 1;
+        push_ffi(L, int64_ffi_unbox);
+        lua_pushlightuserdata(L, &value);
+        lua_pushvalue(L, index);
+        lua_call(L, 2, 0);
+        break;
+#endif
 
     default:
         return luaL_error(L, "argument %d error type %s", index, lua_typename(L,type));
@@ -320,6 +364,26 @@ tostring(lua_State *L) {
 
 #undef get_ab_values
 
+#ifdef PLLUA_FFI
+static void register_ffi(lua_State *L)
+{
+    const char *keys[] = {int64_ffi_box, int64_ffi_unbox,
+                          int64_ffi_toarray, int64_ffi_arraylen};
+    int i;
+    if (luaL_loadbuffer(L, int64_ffi_chunk, sizeof(int64_ffi_chunk) - 1,
+                        "int64 ffi") != 0)
+        elog(ERROR, "[pllua]: could not set up FFI: %s", lua_tostring(L, -1));
+    lua_pushcfunction(L, luaopen_ffi);
+    if (lua_pcall(L, 0, 1, 0) != 0 || lua_pcall(L, 1, 4, 0) != 0)
+        elog(ERROR, "[pllua]: could not set up FFI: %s", lua_tostring(L, -1));
+    for (i = 3; i >= 0; i--) {
+        lua_pushlightuserdata(L, (void *) keys[i]);
+        lua_insert(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+}
+#endif
+
 
 void register_int64(lua_State *L)
 {
@@ -352,6 +416,9 @@ void register_int64(lua_State *L)
         lua_setglobal(L, int64_type_name);
 
     }
+#ifdef PLLUA_FFI
+    register_ffi(L);
+#endif
 }
 
 int64 get64lua(lua_State *L, int index)
@@ -360,7 +427,46 @@ int64 get64lua(lua_State *L, int index)
 }
 
 
+#ifndef PLLUA_NATIVE_INT64
 void setInt64lua(lua_State *L, int64 value)
 {
+#ifdef PLLUA_FFI
+    push_ffi(L, int64_ffi_box);
+    lua_pushlightuserdata(L, &value);
+    lua_call(L, 1, 1);
+#else
     _pushint64(L,value);
+#endif
+}
+#endif
+
+#ifdef PLLUA_FFI
+/* pushes copy of n elements of C type ctype at p as ctype[?] cdata */
+void setCArraylua(lua_State *L, const char *ctype, const void *p, int n)
+{
+    push_ffi(L, int64_ffi_toarray);
+    lua_pushstring(L, ctype);
+    lua_pushlightuserdata(L, (void *) p);
+    lua_pushinteger(L, n);
+    lua_call(L, 3, 1);
 }
+
+/* returns number of elements and sets p to the data if value at index is
+ * ctype[?] cdata, -1 otherwise */
+int getCArraylua(lua_State *L, int index, const char *ctype, const void **p)
+{
+    int n = -1;
+    if (index < 0)
+        index = lua_gettop(L) + index + 1;
+    push_ffi(L, int64_ffi_arraylen);
+    lua_pushstring(L, ctype);
+    lua_pushvalue(L, index);
+    lua_call(L, 2, 1);
+    if (!lua_isnil(L, -1)) {
+        n = (int) lua_tointeger(L, -1);
+        *p = lua_topointer(L, index); /* payload of cdata */
+    }
+    lua_pop(L, 1);
+    return n;
+}
+#endif
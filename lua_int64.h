@@ -8,11 +8,38 @@
 #include <postgres.h>
 
 
+/* int8 values are native integers where lua_Integer has 64 bits (Lua 5.3
+ * and later), and boxed int64 userdata otherwise */
+#if LUA_VERSION_NUM >= 503 && defined(LUA_MAXINTEGER) \
+    && LUA_MAXINTEGER >= 9223372036854775807LL
+#define PLLUA_NATIVE_INT64
+#endif
+
+/* LuaJIT FFI build (make PLLUA_FFI=1): int8 values are int64_t cdata and
+ * fixed-width arrays can be copied to and from FFI arrays */
+#ifdef PLLUA_FFI
+#include <luajit.h>
+#ifndef LUAJIT_VERSION
+#error "PLLUA_FFI requires LuaJIT"
+#endif
+#ifndef LUA_TCDATA
+#define LUA_TCDATA 10 /* not exported by lua.h */
+#endif
+#endif
+
 void register_int64(lua_State * L);
 
 int64 get64lua(lua_State * L,int index);
+#ifdef PLLUA_NATIVE_INT64
+#define setInt64lua(L, value) lua_pushinteger((L), (lua_Integer) (value))
+#else
 void setInt64lua(lua_State * L,int64 value);
+#endif
 
+#ifdef PLLUA_FFI
+void setCArraylua(lua_State * L,const char * ctype,const void * p,int n);
+int getCArraylua(lua_State * L,int index,const char * ctype,const void ** p);
+#endif
 
 
 #endif // LUA_INT64_H
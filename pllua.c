@@ -10,10 +10,18 @@
 
 PG_MODULE_MAGIC;
 
-static lua_State *LuaVM[2] = {NULL, NULL}; /* Lua VMs */
+static lua_State *LuaVM[2] = {NULL, NULL}; /* Lua VMs, created on first use */
 
 LVMInfo lvm_info[2];
 
+int pllua_rows_fetch_size = 50;
+bool pllua_bytecode_cache = false;
+int pllua_max_memory = 0;
+bool pllua_array_views = false;
+int pllua_plan_cache_size = 64;
+bool pllua_numeric_as_double = false;
+int pllua_stream_threshold = 0;
+
 static void init_vmstructs(){
   LVMInfo lvm0;
   LVMInfo lvm1;
@@ -41,45 +49,98 @@ PGDLLEXPORT Datum pllua_inline_handler(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum plluau_inline_handler(PG_FUNCTION_ARGS);
 #endif
 
+#if PG_VERSION_NUM >= 90100
+#define GUC_HOOKS NULL, NULL, NULL
+#else
+#define GUC_HOOKS NULL, NULL
+#endif
+
+static void define_gucs(){
+  DefineCustomIntVariable("pllua.rows_fetch_size",
+      "Initial number of rows fetched at a time by server.rows.",
+      "Grows for long scans unless a batch size is given to rows.",
+      &pllua_rows_fetch_size, 50, 1, INT_MAX / 2, PGC_USERSET, 0,
+      GUC_HOOKS);
+  DefineCustomBoolVariable("pllua.bytecode_cache",
+      "Caches compiled functions on disk for use by other backends.",
+      "Compiled chunks are stored under the pllua_cache directory.",
+      &pllua_bytecode_cache, false, PGC_SUSET, 0,
+      GUC_HOOKS);
+  DefineCustomIntVariable("pllua.max_memory",
+      "Maximum memory used by each Lua state.",
+      "Allocations beyond the limit raise a Lua memory error. "
+      "Zero means no limit.",
+      &pllua_max_memory, 0, 0, INT_MAX / 1024, PGC_SUSET, GUC_UNIT_KB,
+      GUC_HOOKS);
+  DefineCustomBoolVariable("pllua.array_views",
+      "Passes one-dimensional arrays to Lua as views instead of tables.",
+      "Elements of a view are decoded on access.",
+      &pllua_array_views, false, PGC_USERSET, 0,
+      GUC_HOOKS);
+  DefineCustomIntVariable("pllua.plan_cache_size",
+      "Number of plans kept for queries run by server.execute and server.rows.",
+      "Zero disables the cache. Queries with semicolons are never cached.",
+      &pllua_plan_cache_size, 64, 0, INT_MAX / 2, PGC_USERSET, 0,
+      GUC_HOOKS);
+  DefineCustomBoolVariable("pllua.numeric_as_double",
+      "Passes numeric values to Lua as numbers instead of numeric userdata.",
+      "Conversion to double is lossy but allows plain Lua arithmetic.",
+      &pllua_numeric_as_double, false, PGC_USERSET, 0,
+      GUC_HOOKS);
+  DefineCustomIntVariable("pllua.stream_threshold",
+      "Size above which text and bytea values are passed as streams.",
+      "Only applies to values stored out of line without compression. "
+      "Zero disables streams.",
+      &pllua_stream_threshold, 0, 0, INT_MAX / 1024, PGC_USERSET,
+      GUC_UNIT_KB, GUC_HOOKS);
+  EmitWarningsOnPlaceholders("pllua");
+}
+
 #include "pllua_xact_cleanup.h"
 PG_FUNCTION_INFO_V1(_PG_init);
 Datum _PG_init(PG_FUNCTION_ARGS) {
   init_vmstructs();
+  define_gucs();
   pllua_init_common_ctx();
-  LuaVM[0] = luaP_newstate(0); /* untrusted */
-  LuaVM[1] = luaP_newstate(1); /* trusted */
   RegisterXactCallback(pllua_xact_cb, NULL);
   PG_RETURN_VOID();
 }
 
 PG_FUNCTION_INFO_V1(_PG_fini);
 Datum _PG_fini(PG_FUNCTION_ARGS) {
-  luaP_close(LuaVM[0]);
-  luaP_close(LuaVM[1]);
+  if (LuaVM[0] != NULL) luaP_close(LuaVM[0]);
+  if (LuaVM[1] != NULL) luaP_close(LuaVM[1]);
   pllua_delete_common_ctx();
   PG_RETURN_VOID();
 }
 
+/* 0: untrusted, 1: trusted */
+static lua_State *getvm(int trusted) {
+  if (LuaVM[trusted] == NULL)
+    LuaVM[trusted] = luaP_newstate(trusted);
+  return LuaVM[trusted];
+}
+
 PG_FUNCTION_INFO_V1(plluau_validator);
 Datum plluau_validator(PG_FUNCTION_ARGS) {
-  return luaP_validator(LuaVM[0], PG_GETARG_OID(0));
+  return luaP_validator(getvm(0), PG_GETARG_OID(0));
 }
 
 PG_FUNCTION_INFO_V1(plluau_call_handler);
 Datum plluau_call_handler(PG_FUNCTION_ARGS) {
   lvm_info[0].hasTraceback = false;
-  return luaP_callhandler(LuaVM[0], fcinfo);
+  return luaP_callhandler(getvm(0), fcinfo);
 }
 
 PG_FUNCTION_INFO_V1(pllua_validator);
 Datum pllua_validator(PG_FUNCTION_ARGS) {
-  return luaP_validator(LuaVM[1], PG_GETARG_OID(0));
+  return luaP_validator(getvm(1), PG_GETARG_OID(0));
 }
 
 PG_FUNCTION_INFO_V1(pllua_call_handler);
 Datum pllua_call_handler(PG_FUNCTION_ARGS) {
   lvm_info[1].hasTraceback =  false;
-  return luaP_callhandler(LuaVM[1], fcinfo);
+  return luaP_callhandler(getvm(1), fcinfo);
 }
 
 #if PG_VERSION_NUM >= 90000
@@ -89,13 +150,13 @@ Datum pllua_call_handler(PG_FUNCTION_ARGS) {
 PG_FUNCTION_INFO_V1(plluau_inline_handler);
 Datum plluau_inline_handler(PG_FUNCTION_ARGS) {
   lvm_info[0].hasTraceback = false;
-  return luaP_inlinehandler(LuaVM[0], CODEBLOCK);
+  return luaP_inlinehandler(getvm(0), CODEBLOCK);
 }
 
 PG_FUNCTION_INFO_V1(pllua_inline_handler);
 Datum pllua_inline_handler(PG_FUNCTION_ARGS) {
   lvm_info[1].hasTraceback = false;
-  return luaP_inlinehandler(LuaVM[1], CODEBLOCK);
+  return luaP_inlinehandler(getvm(1), CODEBLOCK);
 }
 #endif
 
@@ -14,6 +14,15 @@
 int p_lua_mem_cxt(void);
 int p_lua_master_state(void);
 
+/* GUC variables */
+extern int pllua_rows_fetch_size;
+extern bool pllua_bytecode_cache;
+extern int pllua_max_memory;
+extern bool pllua_array_views;
+extern int pllua_plan_cache_size;
+extern bool pllua_numeric_as_double;
+extern int pllua_stream_threshold;
+
 typedef struct luaP_Buffer {
   int size;
   Datum *value;
@@ -22,12 +31,15 @@ typedef struct luaP_Buffer {
 
 /* utils */
 void *luaP_toudata (lua_State *L, int ud, const char *tname);
+Oid luaP_torawdatum (lua_State *L, int idx, Datum *dat);
 luaP_Buffer *luaP_getbuffer (lua_State *L, int n);
 /* call handler API */
 lua_State *luaP_newstate (int trusted);
 void luaP_close (lua_State *L);
 Datum luaP_validator (lua_State *L, Oid oid);
 Datum luaP_callhandler (lua_State *L, FunctionCallInfo fcinfo);
+/* set while a trigger with transition tables runs */
+extern bool luaP_hasqueryenv;
 #if PG_VERSION_NUM >= 90000
 Datum luaP_inlinehandler (lua_State *L, const char *source);
 #endif
@@ -37,8 +49,11 @@ Datum luaP_todatum (lua_State *L, Oid type, int len, bool *isnull, int idx);
 
 void luaP_pushtuple_trg (lua_State *L, TupleDesc desc, HeapTuple tuple,
     Oid relid, int readonly);
+void luaP_releasetuple (lua_State *L, int idx);
+void luaP_pushtransition (lua_State *L, const char *name);
 HeapTuple luaP_totuple (lua_State *L);
 HeapTuple luaP_casttuple (lua_State *L, TupleDesc tupdesc);
+void luaP_getreldesc (lua_State *L, Oid relid);
 /* SPI */
 void luaP_pushdesctable(lua_State *L, TupleDesc desc);
 void luaP_registerspi(lua_State *L);
@@ -0,0 +1,144 @@
+/*
+ * on-disk cache of compiled function chunks
+ * Please check copyright notice at the bottom of pllua.h
+ *
+ * Chunks are stored with lua_dump under $PGDATA/pllua_cache, one file per
+ * function version:  <database oid>_<function oid>_<xmin>_<block>_<offset>
+ * where xmin and block/offset are the row stamp of the pg_proc tuple, so
+ * CREATE OR REPLACE FUNCTION makes a new entry. Entries of older versions
+ * and of dropped functions and databases are removed when a chunk is
+ * stored. The directory can be removed at any time.
+ */
+
+#include "pllua_bcache.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <lib/stringinfo.h>
+#include <storage/fd.h>
+
+#define BCACHE_DIR "pllua_cache"
+
+static void bcache_name(char *name, Oid fnoid, HeapTuple proc)
+{
+    snprintf(name, MAXPGPATH, "%u_%u_%u_%u_%u.luac", MyDatabaseId, fnoid,
+             HeapTupleHeaderGetXmin(proc->t_data),
+             ItemPointerGetBlockNumber(&proc->t_self),
+             (unsigned) ItemPointerGetOffsetNumber(&proc->t_self));
+}
+
+/* pushes cached chunk of function; returns false if there is none */
+bool bcache_load(lua_State *L, Oid fnoid, HeapTuple proc, const char *chunkname)
+{
+    char name[MAXPGPATH];
+    char path[MAXPGPATH];
+    struct stat st;
+    FILE *f;
+    bool ok = false;
+
+    bcache_name(name, fnoid, proc);
+    snprintf(path, MAXPGPATH, "%s/%s", BCACHE_DIR, name);
+    f = AllocateFile(path, PG_BINARY_R);
+    if (f == NULL)
+        return false;
+    if (fstat(fileno(f), &st) == 0 && st.st_size > 0){
+        char *buf = palloc(st.st_size);
+        /* only binary chunks are accepted */
+        if (fread(buf, 1, st.st_size, f) == (size_t) st.st_size
+                && buf[0] == LUA_SIGNATURE[0]){
+            if (luaL_loadbuffer(L, buf, st.st_size, chunkname) == 0)
+                ok = true;
+            else
+                lua_pop(L, 1); /* error message: built by other Lua? */
+        }
+        pfree(buf);
+    }
+    FreeFile(f);
+    return ok;
+}
+
+static int bcache_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+    (void)L;
+    appendBinaryStringInfo((StringInfo) ud, (const char *) p, (int) sz);
+    return 0;
+}
+
+/* true if entry de_name is not name and belongs to another version of
+ * function fnoid, to a dropped function of this database or to a dropped
+ * database */
+static bool bcache_is_stale(const char *de_name, Oid fnoid, const char *name)
+{
+    unsigned int dboid, oid;
+
+    if (sscanf(de_name, "%u_%u_", &dboid, &oid) != 2
+            || strcmp(de_name, name) == 0)
+        return false;
+    if (dboid != MyDatabaseId)
+        return !SearchSysCacheExists(DATABASEOID, ObjectIdGetDatum(dboid),
+                                     0, 0, 0);
+    return oid == fnoid
+        || !SearchSysCacheExists(PROCOID, ObjectIdGetDatum(oid), 0, 0, 0);
+}
+
+/* removes stale entries, keeping entry name of function fnoid */
+static void bcache_remove_stale(Oid fnoid, const char *name)
+{
+    char path[MAXPGPATH];
+    DIR *dir;
+    struct dirent *de;
+
+    dir = AllocateDir(BCACHE_DIR);
+    while ((de = ReadDir(dir, BCACHE_DIR)) != NULL){
+        size_t l = strlen(de->d_name);
+        if ((l > 4 && strcmp(de->d_name + l - 4, ".tmp") == 0)
+                || !bcache_is_stale(de->d_name, fnoid, name))
+            continue;
+        snprintf(path, MAXPGPATH, "%s/%s", BCACHE_DIR, de->d_name);
+        unlink(path);
+    }
+    FreeDir(dir);
+}
+
+/* stores chunk at the top of the stack */
+void bcache_store(lua_State *L, Oid fnoid, HeapTuple proc)
+{
+    char name[MAXPGPATH];
+    char path[MAXPGPATH];
+    char tmppath[MAXPGPATH];
+    StringInfoData buf;
+    FILE *f;
+    bool ok;
+
+    initStringInfo(&buf);
+#if LUA_VERSION_NUM >= 503
+    lua_dump(L, bcache_writer, &buf, 0);
+#else
+    lua_dump(L, bcache_writer, &buf);
+#endif
+    if (mkdir(BCACHE_DIR, S_IRWXU) != 0 && errno != EEXIST){
+        ereport(LOG, (errcode_for_file_access(),
+                      errmsg("[pllua]: could not create directory \"%s\": %m",
+                             BCACHE_DIR)));
+        pfree(buf.data);
+        return;
+    }
+    bcache_name(name, fnoid, proc);
+    bcache_remove_stale(fnoid, name);
+    snprintf(path, MAXPGPATH, "%s/%s", BCACHE_DIR, name);
+    snprintf(tmppath, MAXPGPATH, "%s.%d.tmp", path, MyProcPid);
+    f = AllocateFile(tmppath, PG_BINARY_W);
+    ok = (f != NULL);
+    if (ok){
+        ok = fwrite(buf.data, 1, buf.len, f) == (size_t) buf.len;
+        if (FreeFile(f) != 0)
+            ok = false;
+    }
+    if (!ok || rename(tmppath, path) != 0){
+        ereport(LOG, (errcode_for_file_access(),
+                      errmsg("[pllua]: could not write file \"%s\": %m",
+                             path)));
+        unlink(tmppath);
+    }
+    pfree(buf.data);
+}
@@ -0,0 +1,14 @@
+/*
+ * on-disk cache of compiled function chunks
+ * Please check copyright notice at the bottom of pllua.h
+ */
+
+#ifndef PLLUA_BCACHE_H
+#define PLLUA_BCACHE_H
+
+#include "plluacommon.h"
+
+bool bcache_load(lua_State *L, Oid fnoid, HeapTuple proc, const char *chunkname);
+void bcache_store(lua_State *L, Oid fnoid, HeapTuple proc);
+
+#endif // PLLUA_BCACHE_H
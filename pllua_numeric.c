@@ -0,0 +1,370 @@
+/*
+ * numeric type support
+ * Please check copyright notice at the bottom of pllua.h
+ *
+ * numeric values are passed to Lua as userdata holding a copy of the
+ * detoasted varlena, with arithmetic metamethods calling the numeric.c
+ * functions directly, so no text conversion takes place. With
+ * pllua.numeric_as_double they are passed as Lua numbers instead.
+ */
+
+#include "pllua_numeric.h"
+
+#include <utils/numeric.h>
+
+#include "pllua.h"
+#include "lua_int64.h"
+#include "pllua_errors.h"
+
+static const char numeric_type_name[] = "numeric";
+
+/* operand of numeric functions, read on the Lua side before any PG call */
+typedef struct {
+    enum {ARG_NUMERIC, ARG_DATUM, ARG_INTEGER, ARG_FLOAT, ARG_STRING} kind;
+    Numeric num; /* userdata, or raw datum possibly toasted */
+    int64 i;
+    double d;
+    const char *str;
+} numeric_arg;
+
+static void *test_udata(lua_State *L, int index, const char *tname)
+{
+    void *p = lua_touserdata(L, index);
+    if (p != NULL && lua_getmetatable(L, index)) {
+        luaL_getmetatable(L, tname);
+        if (!lua_rawequal(L, -1, -2))
+            p = NULL;
+        lua_pop(L, 2);
+        return p;
+    }
+    return NULL;
+}
+
+static Numeric test_numeric(lua_State *L, int index)
+{
+    return (Numeric) test_udata(L, index, numeric_type_name);
+}
+
+static bool to_arg(lua_State *L, int index, numeric_arg *arg)
+{
+    arg->num = test_numeric(L, index);
+    if (arg->num != NULL) {
+        arg->kind = ARG_NUMERIC;
+        return true;
+    }
+    switch (lua_type(L, index)) {
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+        if (lua_isinteger(L, index)) {
+            arg->kind = ARG_INTEGER;
+            arg->i = (int64) lua_tointeger(L, index);
+            return true;
+        }
+#endif
+        arg->kind = ARG_FLOAT;
+        arg->d = (double) lua_tonumber(L, index);
+        return true;
+    case LUA_TSTRING:
+        arg->kind = ARG_STRING;
+        arg->str = lua_tostring(L, index);
+        return true;
+    case LUA_TUSERDATA: {
+        Datum d;
+        Oid type = luaP_torawdatum(L, index, &d);
+        if (type == NUMERICOID) { /* raw datum of numeric or numeric domain */
+            arg->kind = ARG_DATUM;
+            arg->num = (Numeric) DatumGetPointer(d);
+            return true;
+        }
+        if (type != InvalidOid || test_udata(L, index, "int64") == NULL)
+            return false;
+        arg->kind = ARG_INTEGER;
+        arg->i = get64lua(L, index);
+        return true;
+    }
+#ifdef PLLUA_FFI
+    case LUA_TCDATA:
+        arg->kind = ARG_INTEGER; /* int64 */
+        arg->i = get64lua(L, index);
+        return true;
+#endif
+    }
+    return false;
+}
+
+static void check_arg(lua_State *L, int index, numeric_arg *arg)
+{
+    if (!to_arg(L, index, arg))
+        luaL_error(L, "attempt to perform arithmetic on a %s value",
+                   luaL_typename(L, index));
+}
+
+/* numeric datum of arg; may raise PG errors */
+static Datum make_arg(numeric_arg *arg)
+{
+    switch (arg->kind) {
+    case ARG_INTEGER:
+        return DirectFunctionCall1(int8_numeric, Int64GetDatum(arg->i));
+    case ARG_FLOAT:
+        return DirectFunctionCall1(float8_numeric, Float8GetDatum(arg->d));
+    case ARG_STRING:
+        return DirectFunctionCall3(numeric_in, CStringGetDatum(arg->str),
+                                   ObjectIdGetDatum(InvalidOid),
+                                   Int32GetDatum(-1));
+    default:
+        return NumericGetDatum(arg->num);
+    }
+}
+
+static void free_arg(numeric_arg *arg, Datum value)
+{
+    if (arg->kind != ARG_NUMERIC && arg->kind != ARG_DATUM)
+        pfree(DatumGetPointer(value));
+}
+
+/* pushes copy of r as userdata and frees r unless it is one of the
+ * operands a and b */
+static void push_result(lua_State *L, Numeric r, Numeric a, Numeric b)
+{
+    Size size = VARSIZE(r);
+    void *p = lua_newuserdata(L, size);
+    memcpy(p, r, size);
+    if (r != a && r != b)
+        pfree(r);
+    luaL_getmetatable(L, numeric_type_name);
+    lua_setmetatable(L, -2);
+}
+
+static void push_string(lua_State *L, Numeric n)
+{
+    char *s = NULL;
+    PLLUA_PG_CATCH_RETHROW(
+        s = DatumGetCString(DirectFunctionCall1(numeric_out,
+                                                NumericGetDatum(n)));
+    );
+    lua_pushstring(L, s);
+    pfree(s);
+}
+
+static int numeric_binary(lua_State *L, PGFunction fn)
+{
+    numeric_arg a, b;
+    Numeric r = NULL;
+    check_arg(L, 1, &a);
+    check_arg(L, 2, &b);
+    PLLUA_PG_CATCH_RETHROW(
+        Datum x = make_arg(&a);
+        Datum y = make_arg(&b);
+        r = DatumGetNumeric(DirectFunctionCall2(fn, x, y));
+        free_arg(&a, x);
+        free_arg(&b, y);
+    );
+    push_result(L, r, a.num, b.num);
+    return 1;
+}
+
+static int numeric_unary(lua_State *L, PGFunction fn)
+{
+    numeric_arg a;
+    Numeric r = NULL;
+    check_arg(L, 1, &a);
+    PLLUA_PG_CATCH_RETHROW(
+        Datum x = make_arg(&a);
+        r = DatumGetNumeric(DirectFunctionCall1(fn, x));
+        free_arg(&a, x);
+    );
+    push_result(L, r, a.num, NULL);
+    return 1;
+}
+
+static int numeric_scaled(lua_State *L, PGFunction fn)
+{
+    numeric_arg a;
+    Numeric r = NULL;
+    int scale;
+    check_arg(L, 1, &a);
+    scale = (int) luaL_optinteger(L, 2, 0);
+    PLLUA_PG_CATCH_RETHROW(
+        Datum x = make_arg(&a);
+        r = DatumGetNumeric(DirectFunctionCall2(fn, x, Int32GetDatum(scale)));
+        free_arg(&a, x);
+    );
+    push_result(L, r, a.num, NULL);
+    return 1;
+}
+
+static int32 numeric_compare(lua_State *L)
+{
+    numeric_arg a, b;
+    int32 c = 0;
+    check_arg(L, 1, &a);
+    check_arg(L, 2, &b);
+    PLLUA_PG_CATCH_RETHROW(
+        Datum x = make_arg(&a);
+        Datum y = make_arg(&b);
+        c = DatumGetInt32(DirectFunctionCall2(numeric_cmp, x, y));
+        free_arg(&a, x);
+        free_arg(&b, y);
+    );
+    return c;
+}
+
+static int numeric_add_lua(lua_State *L) { return numeric_binary(L, numeric_add); }
+static int numeric_sub_lua(lua_State *L) { return numeric_binary(L, numeric_sub); }
+static int numeric_mul_lua(lua_State *L) { return numeric_binary(L, numeric_mul); }
+static int numeric_div_lua(lua_State *L) { return numeric_binary(L, numeric_div); }
+static int numeric_mod_lua(lua_State *L) { return numeric_binary(L, numeric_mod); }
+static int numeric_pow_lua(lua_State *L) { return numeric_binary(L, numeric_power); }
+#if LUA_VERSION_NUM >= 503
+static int numeric_idiv_lua(lua_State *L) { return numeric_binary(L, numeric_div_trunc); }
+#endif
+static int numeric_unm_lua(lua_State *L) { return numeric_unary(L, numeric_uminus); }
+static int numeric_abs_lua(lua_State *L) { return numeric_unary(L, numeric_abs); }
+static int numeric_round_lua(lua_State *L) { return numeric_scaled(L, numeric_round); }
+static int numeric_trunc_lua(lua_State *L) { return numeric_scaled(L, numeric_trunc); }
+
+static int numeric_eq_lua(lua_State *L)
+{
+    lua_pushboolean(L, numeric_compare(L) == 0);
+    return 1;
+}
+
+static int numeric_lt_lua(lua_State *L)
+{
+    lua_pushboolean(L, numeric_compare(L) < 0);
+    return 1;
+}
+
+static int numeric_le_lua(lua_State *L)
+{
+    lua_pushboolean(L, numeric_compare(L) <= 0);
+    return 1;
+}
+
+/* numeric.new(x): x is a number, string, int64 or numeric */
+static int numeric_new_lua(lua_State *L)
+{
+    numeric_arg a;
+    Numeric r = NULL;
+    check_arg(L, 1, &a);
+    if (a.kind == ARG_NUMERIC) {
+        lua_settop(L, 1);
+        return 1;
+    }
+    PLLUA_PG_CATCH_RETHROW(
+        r = DatumGetNumeric(make_arg(&a)); /* detoasts raw datum */
+    );
+    push_result(L, r, a.kind == ARG_DATUM ? a.num : NULL, NULL);
+    return 1;
+}
+
+static int numeric_tonumber_lua(lua_State *L)
+{
+    numeric_arg a;
+    float8 d = 0;
+    check_arg(L, 1, &a);
+    PLLUA_PG_CATCH_RETHROW(
+        Datum x = make_arg(&a);
+        d = DatumGetFloat8(DirectFunctionCall1(numeric_float8, x));
+        free_arg(&a, x);
+    );
+    lua_pushnumber(L, (lua_Number) d);
+    return 1;
+}
+
+static int numeric_tostring_lua(lua_State *L)
+{
+    Numeric n = test_numeric(L, 1);
+    if (n == NULL)
+        return luaL_error(L, "numeric expected, got %s", luaL_typename(L, 1));
+    push_string(L, n);
+    return 1;
+}
+
+static int numeric_concat_lua(lua_State *L)
+{
+    int i;
+    for (i = 1; i <= 2; i++) {
+        Numeric n = test_numeric(L, i);
+        if (n != NULL)
+            push_string(L, n);
+        else
+            lua_pushvalue(L, i);
+    }
+    lua_concat(L, 2);
+    return 1;
+}
+
+void register_numeric(lua_State *L)
+{
+    luaL_Reg regs[] =
+    {
+        { "new", numeric_new_lua },
+        { "tonumber", numeric_tonumber_lua },
+        { "tostring", numeric_tostring_lua },
+        { "abs", numeric_abs_lua },
+        { "round", numeric_round_lua },
+        { "trunc", numeric_trunc_lua },
+        { "__add", numeric_add_lua },
+        { "__sub", numeric_sub_lua },
+        { "__mul", numeric_mul_lua },
+        { "__div", numeric_div_lua },
+        { "__mod", numeric_mod_lua },
+        { "__pow", numeric_pow_lua },
+#if LUA_VERSION_NUM >= 503
+        { "__idiv", numeric_idiv_lua },
+#endif
+        { "__unm", numeric_unm_lua },
+        { "__eq", numeric_eq_lua },
+        { "__lt", numeric_lt_lua },
+        { "__le", numeric_le_lua },
+        { "__concat", numeric_concat_lua },
+        { "__tostring", numeric_tostring_lua },
+        { NULL, NULL }
+    };
+    luaL_newmetatable(L, numeric_type_name);
+    luaL_setfuncs(L, regs, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_setglobal(L, numeric_type_name);
+}
+
+/* pushes numeric datum as userdata, or as a Lua number with
+ * pllua.numeric_as_double */
+void push_numeric(lua_State *L, Datum value)
+{
+    Numeric n = DatumGetNumeric(value); /* detoasted */
+    if (pllua_numeric_as_double)
+        lua_pushnumber(L, (lua_Number) DatumGetFloat8(
+                           DirectFunctionCall1(numeric_float8,
+                                               NumericGetDatum(n))));
+    else {
+        Size size = VARSIZE(n);
+        void *p = lua_newuserdata(L, size);
+        memcpy(p, n, size);
+        luaL_getmetatable(L, numeric_type_name);
+        lua_setmetatable(L, -2);
+    }
+    if ((Pointer) n != DatumGetPointer(value))
+        pfree(n);
+}
+
+/* converts value at index to numeric datum, coerced to typmod if valid;
+ * result is allocated in upper memory context */
+Datum get_numeric(lua_State *L, int index, int32 typmod)
+{
+    numeric_arg arg;
+    Datum value;
+    Size size;
+    void *p;
+    if (!to_arg(L, index, &arg))
+        elog(ERROR, "[pllua]: numeric expected for datum conversion, got %s",
+             luaL_typename(L, index));
+    value = make_arg(&arg);
+    if (typmod >= (int32) VARHDRSZ)
+        value = DirectFunctionCall2(numeric, value, Int32GetDatum(typmod));
+    size = VARSIZE_ANY(DatumGetPointer(value));
+    p = SPI_palloc(size);
+    memcpy(p, DatumGetPointer(value), size);
+    return PointerGetDatum(p);
+}
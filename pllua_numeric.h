@@ -0,0 +1,15 @@
+/*
+ * numeric type support
+ * Please check copyright notice at the bottom of pllua.h
+ */
+
+#ifndef PLLUA_NUMERIC_H
+#define PLLUA_NUMERIC_H
+
+#include "plluacommon.h"
+
+void register_numeric(lua_State *L);
+void push_numeric(lua_State *L, Datum value);
+Datum get_numeric(lua_State *L, int index, int32 typmod);
+
+#endif // PLLUA_NUMERIC_H
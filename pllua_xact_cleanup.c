@@ -27,6 +27,7 @@ typedef struct RSStack {
 } RSStack, *RSStaskPtr;
 
 static RSStaskPtr resource_stk = NULL;
+static uint32 xact_generation = 0; /* bumped at transaction end */
 
 static RSNodePtr rsp_push(RSStaskPtr S, void *d, RSDtorCallback dtor) {
     RSNodePtr np;
@@ -125,9 +126,15 @@ void pllua_xact_cb(XactEvent event, void *arg)
     //TODO: check events
     (void)event;
     (void)arg;
+    xact_generation++;
     clean(resource_stk);
 }
 
+uint32 get_xact_generation()
+{
+    return xact_generation;
+}
+
 
 void pllua_init_common_ctx()
 {
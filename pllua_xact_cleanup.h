@@ -15,6 +15,7 @@ MemoryContext get_common_ctx(void);
 void pllua_init_common_ctx(void);
 void pllua_delete_common_ctx(void);
 void pllua_xact_cb(XactEvent event, void *arg);
+uint32 get_xact_generation(void);
 
 void *register_resource(void *d, RSDtorCallback dtor);
 void *unregister_resource(void* d);
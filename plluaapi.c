@@ -12,6 +12,9 @@
 #include "pllua_pgfunc.h"
 #include "pllua_subxact.h"
 #include "pllua_errors.h"
+#include "pllua_bcache.h"
+#include "pllua_numeric.h"
+#include "pllua_xact_cleanup.h"
 
 
 /*
@@ -19,34 +22,27 @@
  * [general]
  * REG[light(L)] = memcontext
  * [type]
- * REG[oid(type)] = typeinfo
+ * REG[PLLUA_TYPES][oid(type)] = typeinfo
  * REG[PLLUA_TYPEINFO] = typeinfo_MT
  * REG[PLLUA_DATUM] = datum_MT
+ * REG[PLLUA_ARRAY] = array_MT
+ * REG[PLLUA_STREAM] = stream_MT
+ * REG[PLLUA_WRITER] = writer_MT
  * [trigger]
- * REG[rel_id] = desc_table
- * REG[relname] = rel_table
+ * REG[PLLUA_RELATIONS][rel_id] = desc_table
+ * REG[PLLUA_RELTABLES][rel_id] = rel_table
+ * REG[PLLUA_RELINVAL] = invalidation count seen by rel tables
+ * REG[PLLUA_TRIGGERTABLE] = trigger table reused between calls
  * [call handler]
  * REG[light(info)] = func
- * REG[oid(func)] = info
+ * REG[PLLUA_FUNCTIONS][oid(func)] = info
  * REG[light(thread)] = thread
  */
 
-/* extended function info */
-typedef struct luaP_Info {
-  RTupDescStack funcxt_wp; /* weak if init_weak used */
-  bool code_storage;
-  int oid;
-  int vararg;
-  Oid result;
-  bool result_isset;
-  struct RowStamp stamp; /* detect pg_proc row changes */
-  lua_State *L; /* thread for SETOF iterator */
-  Oid arg[1];
-} luaP_Info;
-
 /* extended type info */
 typedef struct luaP_Typeinfo {
   int oid;
+  Oid base; /* base type for domains, else oid */
   int16 len;
   char type;
   char align;
@@ -55,8 +51,33 @@ typedef struct luaP_Typeinfo {
   FmgrInfo input;
   FmgrInfo output;
   TupleDesc tupdesc;
+  int attnames; /* registry ref of attribute names, composite only */
+  Datum *values; /* deform buffer, composite only */
+  bool *nulls;
 } luaP_Typeinfo;
 
+/* precompiled datum conversion for a function argument or result */
+typedef struct luaP_Conv {
+  Oid type;
+  luaP_Typeinfo *ti; /* anchored at registry */
+  void (*push) (lua_State *L, Datum dat, struct luaP_Conv *c);
+  Datum (*to) (lua_State *L, struct luaP_Conv *c, bool *isnull, int idx);
+} luaP_Conv;
+
+/* extended function info */
+typedef struct luaP_Info {
+  RTupDescStack funcxt_wp; /* weak if init_weak used */
+  bool code_storage;
+  int oid;
+  int vararg;
+  Oid result;
+  bool result_isset;
+  struct RowStamp stamp; /* detect pg_proc row changes */
+  lua_State *L; /* thread for SETOF iterator */
+  luaP_Conv rconv; /* result */
+  luaP_Conv arg[1];
+} luaP_Info;
+
 /* raw datum */
 typedef struct luaP_Datum {
   int issaved;
@@ -64,8 +85,43 @@ typedef struct luaP_Datum {
   luaP_Typeinfo *ti;
 } luaP_Datum;
 
+/* array view: one-dimensional array decoded on demand */
+typedef struct luaP_Array {
+  ArrayType *arr; /* detoasted copy in Lua memory context */
+  luaP_Typeinfo *ti; /* anchored at registry */
+  luaP_Typeinfo *te;
+  int lb;
+  int n;
+  int stride; /* element size if fixed-width without nulls, else 0 */
+  int32 *offsets; /* data offsets, -1 for nulls; built on first access */
+} luaP_Array;
+
+/* reader of a value stored out of line without compression */
+typedef struct luaP_Stream {
+  int32 size; /* raw data size */
+  int32 pos;
+  uint32 xact; /* transaction generation: pointer is only valid in it */
+  struct varlena *ptr; /* copy of toast pointer, stored after struct */
+} luaP_Stream;
+
+/* string builder for large text and bytea results */
+typedef struct luaP_Writer {
+  char *data; /* in Lua memory context */
+  Size len;
+  Size size;
+} luaP_Writer;
+
 static const char PLLUA_TYPEINFO[] = "typeinfo";
 static const char PLLUA_DATUM[] = "datum";
+static const char PLLUA_ARRAY[] = "array";
+static const char PLLUA_STREAM[] = "stream";
+static const char PLLUA_WRITER[] = "writer";
+static const char PLLUA_FUNCTIONS[] = "functions";
+static const char PLLUA_TYPES[] = "types";
+static const char PLLUA_RELATIONS[] = "relations";
+static const char PLLUA_RELTABLES[] = "reltables";
+static const char PLLUA_RELINVAL[] = "relinval";
+static const char PLLUA_TRIGGERTABLE[] = "triggertable";
 
 #define PLLUA_LOCALVAR "_U"
 #define PLLUA_SHAREDVAR "shared"
@@ -107,9 +163,11 @@ static int luaP_panic(lua_State *L){
 
 /* string2text is simpler, so we implement it here with allocation in upper
  * memory context */
-static Datum string2text (const char *str) {
-  int l = strlen(str);
-  text *dat = (text *) SPI_palloc(l + VARHDRSZ); /* in upper context */
+static Datum string2text (const char *str, size_t l) {
+  text *dat;
+  if (l > MaxAllocSize - VARHDRSZ)
+    elog(ERROR, "[pllua]: string too long for datum conversion");
+  dat = (text *) SPI_palloc(l + VARHDRSZ); /* in upper context */
   SET_VARSIZE(dat, l + VARHDRSZ);
   memcpy(VARDATA(dat), str, l);
   return PointerGetDatum(dat);
@@ -134,13 +192,15 @@ static Datum datumcopy (Datum dat, luaP_Typeinfo *ti) {
 static int luaP_typeinfogc (lua_State *L) {
   luaP_Typeinfo *ti = lua_touserdata(L, 1);
   if (ti->tupdesc) FreeTupleDesc(ti->tupdesc);
+  if (ti->values) pfree(ti->values);
+  if (ti->nulls) pfree(ti->nulls);
+  luaL_unref(L, LUA_REGISTRYINDEX, ti->attnames);
   return 0;
 }
 
 static luaP_Typeinfo *luaP_gettypeinfo (lua_State *L, int oid) {
   luaP_Typeinfo *ti;
-  lua_push_oidstring(L, oid);
-  lua_rawget(L, LUA_REGISTRYINDEX);
+  luaP_getoidcache(L, PLLUA_TYPES, oid);
   if (lua_isnil(L, -1)) { /* not cached? */
     HeapTuple type;
     Form_pg_type typeinfo;
@@ -152,6 +212,8 @@ static luaP_Typeinfo *luaP_gettypeinfo (lua_State *L, int oid) {
     typeinfo = (Form_pg_type) GETSTRUCT(type);
     /* cache */
     ti = lua_newuserdata(L, sizeof(luaP_Typeinfo));
+    ti->oid = oid;
+    ti->base = (typeinfo->typtype == TYPTYPE_DOMAIN) ? getBaseType(oid) : oid;
     ti->len = typeinfo->typlen;
     ti->type = typeinfo->typtype;
     ti->align = typeinfo->typalign;
@@ -160,22 +222,35 @@ static luaP_Typeinfo *luaP_gettypeinfo (lua_State *L, int oid) {
     fmgr_info_cxt(typeinfo->typinput, &ti->input, mcxt);
     fmgr_info_cxt(typeinfo->typoutput, &ti->output, mcxt);
     ti->tupdesc = NULL;
+    ti->attnames = LUA_NOREF;
+    ti->values = NULL;
+    ti->nulls = NULL;
     if (ti->type == TYPTYPE_COMPOSITE) {
       TupleDesc td = lookup_rowtype_tupdesc(oid, typeinfo->typtypmod);
       MemoryContext m = MemoryContextSwitchTo(mcxt);
+      int i, natts = td->natts;
       ti->tupdesc = CreateTupleDescCopyConstr(td);
+      ti->values = (Datum *) palloc(natts * sizeof(Datum));
+      ti->nulls = (bool *) palloc(natts * sizeof(bool));
       MemoryContextSwitchTo(m);
       BlessTupleDesc(ti->tupdesc);
       ReleaseTupleDesc(td);
+      /* attribute names as Lua strings; dropped attributes are skipped */
+      lua_createtable(L, natts, 0);
+      for (i = 0; i < natts; i++) {
+        Form_pg_attribute att = TupleDescAttr(ti->tupdesc, i);
+        if (att->attisdropped) continue;
+        lua_pushstring(L, NameStr(att->attname));
+        lua_rawseti(L, -2, i + 1);
+      }
+      ti->attnames = luaL_ref(L, LUA_REGISTRYINDEX);
     }
     ReleaseSysCache(type);
     lua_pushlightuserdata(L, (void *) PLLUA_TYPEINFO);
     lua_rawget(L, LUA_REGISTRYINDEX); /* Typeinfo_MT */
     lua_setmetatable(L, -2);
-    lua_push_oidstring(L, oid);
-    lua_pushvalue(L, -2);
-    lua_rawset(L, LUA_REGISTRYINDEX); /* REG[oid] = typeinfo */
-    lua_pop(L, 2); /* nil and typeinfo */
+    luaP_setoidcache(L, PLLUA_TYPES, oid); /* REG[TYPES][oid] = typeinfo */
+    lua_pop(L, 1); /* nil */
   }
   else {
     ti = lua_touserdata(L, -1);
@@ -184,6 +259,11 @@ static luaP_Typeinfo *luaP_gettypeinfo (lua_State *L, int oid) {
   return ti;
 }
 
+/* pushes attribute table of relation relid cached by last trigger call */
+void luaP_getreldesc (lua_State *L, Oid relid) {
+  luaP_getoidcache(L, PLLUA_RELATIONS, relid);
+}
+
 /* ======= Datum ======= */
 
 static int luaP_datumtostring (lua_State *L) {
@@ -232,64 +312,456 @@ static luaP_Datum *luaP_pushrawdatum (lua_State *L, Datum dat,
   return d;
 }
 
+/* base type of raw datum at idx and its value; InvalidOid if not a raw
+ * datum */
+Oid luaP_torawdatum (lua_State *L, int idx, Datum *dat) {
+  luaP_Datum *d = luaP_toudata(L, idx, PLLUA_DATUM);
+  if (d == NULL) return InvalidOid;
+  *dat = d->datum;
+  return d->ti->base;
+}
+
+/* ======= Streams ======= */
+
+#define PLLUA_CHUNKSIZE 65536
+
+/* only values stored out of line without compression can be read in
+ * slices without fetching them whole */
+static bool luaP_isstreamable (struct varlena *v) {
+  struct varatt_external ve;
+  if (pllua_stream_threshold <= 0 || !VARATT_IS_EXTERNAL_ONDISK(v))
+    return false;
+  VARATT_EXTERNAL_GET_POINTER(ve, v);
+  return !VARATT_EXTERNAL_IS_COMPRESSED(ve)
+    && ve.va_rawsize - VARHDRSZ > (int64) pllua_stream_threshold * 1024;
+}
+
+static void luaP_pushstream (lua_State *L, struct varlena *v) {
+  Size l = VARSIZE_ANY(v);
+  struct varatt_external ve;
+  luaP_Stream *s = lua_newuserdata(L, sizeof(luaP_Stream) + l);
+  VARATT_EXTERNAL_GET_POINTER(ve, v);
+  s->size = ve.va_rawsize - VARHDRSZ;
+  s->pos = 0;
+  s->xact = get_xact_generation();
+  s->ptr = (struct varlena *) (s + 1);
+  memcpy(s->ptr, v, l);
+  lua_pushlightuserdata(L, (void *) PLLUA_STREAM);
+  lua_rawget(L, LUA_REGISTRYINDEX); /* Stream_MT */
+  lua_setmetatable(L, -2);
+}
+
+static luaP_Stream *luaP_checkstream (lua_State *L, int narg) {
+  luaP_Stream *s = luaP_toudata(L, narg, PLLUA_STREAM);
+  if (s == NULL) {
+    const char *msg = lua_pushfstring(L, "%s expected, got %s",
+        PLLUA_STREAM, luaL_typename(L, narg));
+    luaL_argerror(L, narg, msg);
+  }
+  return s;
+}
+
+/* the TOAST pointer of a stream may be dangling once its transaction ends */
+static void luaP_streamcheckxact (lua_State *L, luaP_Stream *s) {
+  if (s->xact != get_xact_generation())
+    luaL_error(L, "stream used after the end of its transaction");
+}
+
+/* pushes next n bytes of s, or nil at end */
+static int luaP_streamchunk (lua_State *L, luaP_Stream *s, int32 n) {
+  struct varlena *v = NULL;
+  luaP_streamcheckxact(L, s);
+  if (s->pos >= s->size) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if (n > s->size - s->pos) n = s->size - s->pos;
+  if (n <= 0) {
+    lua_pushliteral(L, "");
+    return 1;
+  }
+  PLLUA_PG_CATCH_RETHROW(
+    v = heap_tuple_untoast_attr_slice(s->ptr, s->pos, n);
+  );
+  s->pos += VARSIZE_ANY_EXHDR(v);
+  lua_pushlstring(L, VARDATA_ANY(v), VARSIZE_ANY_EXHDR(v));
+  pfree(v);
+  return 1;
+}
+
+/* s:read([n]) reads n bytes, or the rest of the value */
+static int luaP_streamread (lua_State *L) {
+  luaP_Stream *s = luaP_checkstream(L, 1);
+  lua_Integer n = luaL_optinteger(L, 2, s->size - s->pos);
+  return luaP_streamchunk(L, s, (n > s->size) ? s->size : (int32) n);
+}
+
+static int luaP_streamnext (lua_State *L) {
+  luaP_Stream *s = luaP_checkstream(L, 1);
+  return luaP_streamchunk(L, s,
+      (int32) lua_tointeger(L, lua_upvalueindex(1)));
+}
+
+/* s:chunks([size]) iterates over the rest of the value */
+static int luaP_streamchunks (lua_State *L) {
+  lua_Integer n = luaL_optinteger(L, 2, PLLUA_CHUNKSIZE);
+  luaP_checkstream(L, 1);
+  luaL_argcheck(L, n > 0 && n <= INT_MAX, 2, "invalid chunk size");
+  lua_pushinteger(L, n);
+  lua_pushcclosure(L, luaP_streamnext, 1);
+  lua_pushvalue(L, 1);
+  return 2;
+}
+
+/* s:seek([pos]) sets byte offset from the start; returns offset */
+static int luaP_streamseek (lua_State *L) {
+  luaP_Stream *s = luaP_checkstream(L, 1);
+  if (!lua_isnoneornil(L, 2)) {
+    lua_Integer pos = luaL_checkinteger(L, 2);
+    s->pos = (pos < 0) ? 0 : (pos > s->size) ? s->size : (int32) pos;
+  }
+  lua_pushinteger(L, s->pos);
+  return 1;
+}
+
+static int luaP_streamlen (lua_State *L) {
+  luaP_Stream *s = luaP_checkstream(L, 1);
+  lua_pushinteger(L, s->size);
+  return 1;
+}
+
+static int luaP_streamtostring (lua_State *L) {
+  luaP_Stream *s = luaP_checkstream(L, 1);
+  struct varlena *v = NULL;
+  luaP_streamcheckxact(L, s);
+  PLLUA_PG_CATCH_RETHROW(
+    v = heap_tuple_untoast_attr(s->ptr);
+  );
+  lua_pushlstring(L, VARDATA(v), VARSIZE(v) - VARHDRSZ);
+  pfree(v);
+  return 1;
+}
+
+static luaP_Writer *luaP_checkwriter (lua_State *L, int narg) {
+  luaP_Writer *w = luaP_toudata(L, narg, PLLUA_WRITER);
+  if (w == NULL) {
+    const char *msg = lua_pushfstring(L, "%s expected, got %s",
+        PLLUA_WRITER, luaL_typename(L, narg));
+    luaL_argerror(L, narg, msg);
+  }
+  return w;
+}
+
+/* writer([size]) returns string builder with initial capacity size */
+static int luaP_newwriter (lua_State *L) {
+  lua_Integer n = luaL_optinteger(L, 1, 1024);
+  luaP_Writer *w;
+  luaL_argcheck(L, n > 0 && (Size) n <= MaxAllocSize - VARHDRSZ, 1,
+      "invalid size");
+  w = lua_newuserdata(L, sizeof(luaP_Writer));
+  w->data = NULL;
+  w->len = w->size = 0;
+  lua_pushlightuserdata(L, (void *) PLLUA_WRITER);
+  lua_rawget(L, LUA_REGISTRYINDEX); /* Writer_MT */
+  lua_setmetatable(L, -2);
+  w->data = (char *) MemoryContextAlloc(luaP_getmemctxt(L), n);
+  w->size = n;
+  return 1;
+}
+
+/* w:write(...) appends strings; returns w */
+static int luaP_writerwrite (lua_State *L) {
+  luaP_Writer *w = luaP_checkwriter(L, 1);
+  int i, n = lua_gettop(L);
+  for (i = 2; i <= n; i++) {
+    size_t l;
+    const char *s = luaL_checklstring(L, i, &l);
+    if (w->len + l > w->size) { /* grow? */
+      Size size = w->size;
+      if (l > MaxAllocSize - VARHDRSZ - w->len)
+        return luaL_error(L, "writer size exceeds the maximum allowed");
+      while (size < w->len + l) size *= 2;
+      if (size > MaxAllocSize - VARHDRSZ) size = MaxAllocSize - VARHDRSZ;
+      w->data = (char *) repalloc(w->data, size);
+      w->size = size;
+    }
+    memcpy(w->data + w->len, s, l);
+    w->len += l;
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int luaP_writerlen (lua_State *L) {
+  luaP_Writer *w = luaP_checkwriter(L, 1);
+  lua_pushinteger(L, (lua_Integer) w->len);
+  return 1;
+}
+
+static int luaP_writertostring (lua_State *L) {
+  luaP_Writer *w = luaP_checkwriter(L, 1);
+  lua_pushlstring(L, w->data, w->len);
+  return 1;
+}
+
+static int luaP_writergc (lua_State *L) {
+  luaP_Writer *w = lua_touserdata(L, 1);
+  if (w->data != NULL) pfree(w->data);
+  return 0;
+}
+
+static void luaP_registerstream (lua_State *L) {
+  const luaL_Reg stream_methods[] = {
+    {"read", luaP_streamread},
+    {"chunks", luaP_streamchunks},
+    {"seek", luaP_streamseek},
+    {NULL, NULL}
+  };
+  const luaL_Reg writer_methods[] = {
+    {"write", luaP_writerwrite},
+    {NULL, NULL}
+  };
+  lua_pushlightuserdata(L, (void *) PLLUA_STREAM);
+  lua_newtable(L); /* luaP_Stream MT */
+  lua_createtable(L, 0, 3);
+  luaP_register(L, stream_methods);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, luaP_streamlen);
+  lua_setfield(L, -2, "__len");
+  lua_pushcfunction(L, luaP_streamtostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  lua_pushlightuserdata(L, (void *) PLLUA_WRITER);
+  lua_newtable(L); /* luaP_Writer MT */
+  lua_createtable(L, 0, 1);
+  luaP_register(L, writer_methods);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, luaP_writerlen);
+  lua_setfield(L, -2, "__len");
+  lua_pushcfunction(L, luaP_writertostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushcfunction(L, luaP_writergc);
+  lua_setfield(L, -2, "__gc");
+  lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+/* pushes text, bpchar, varchar or bytea dat as string straight from its
+ * data, without a cstring copy; embedded zeros are kept */
+static void luaP_pushvarlena (lua_State *L, Datum dat) {
+  struct varlena *v = (struct varlena *) DatumGetPointer(dat);
+  if (luaP_isstreamable(v)) {
+    luaP_pushstream(L, v);
+    return;
+  }
+  v = PG_DETOAST_DATUM_PACKED(dat);
+  lua_pushlstring(L, VARDATA_ANY(v), VARSIZE_ANY_EXHDR(v));
+  if ((Pointer) v != DatumGetPointer(dat)) pfree(v);
+}
+
+/* converts string, writer, stream or raw datum of the same type at idx to
+ * text, bpchar, varchar or bytea; bpchar and varchar are coerced to a valid
+ * typmod. Result is allocated in upper memory context */
+static Datum luaP_tovarlena (lua_State *L, Oid type, int typmod, int idx) {
+  Datum dat;
+  luaP_Writer *w = NULL;
+  luaP_Stream *st = NULL;
+  luaP_Datum *d = NULL;
+  if (lua_type(L, idx) == LUA_TUSERDATA) {
+    w = luaP_toudata(L, idx, PLLUA_WRITER);
+    if (w == NULL) st = luaP_toudata(L, idx, PLLUA_STREAM);
+    if (w == NULL && st == NULL) {
+      d = luaP_toudata(L, idx, PLLUA_DATUM);
+      if (d != NULL && d->ti->base != type) elog(ERROR,
+          "[pllua]: raw datum of type '%s' cannot be converted to '%s'",
+          format_type_be(d->ti->oid), format_type_be(type));
+    }
+  }
+  if (w != NULL)
+    dat = string2text(w->data, w->len);
+  else if (d != NULL)
+    dat = datumcopy(d->datum, d->ti);
+  else if (st != NULL) { /* fetch in a protected call */
+    size_t l;
+    const char *s;
+    if (idx < 0) idx = lua_gettop(L) + idx + 1; /* absolute */
+    lua_pushcfunction(L, luaP_streamtostring);
+    lua_pushvalue(L, idx);
+    if (lua_pcall(L, 1, 1, 0)) luapg_error(L, "stream");
+    s = lua_tolstring(L, -1, &l);
+    dat = string2text(s, l);
+    lua_pop(L, 1);
+  }
+  else {
+    size_t l;
+    const char *s = lua_tolstring(L, idx, &l);
+    if (s == NULL) elog(ERROR,
+        "[pllua]: string expected for datum conversion, got %s",
+        lua_typename(L, lua_type(L, idx)));
+    dat = string2text(s, l);
+  }
+  if (typmod >= (int) VARHDRSZ && (type == BPCHAROID
+        || type == VARCHAROID)) {
+    Datum c = DirectFunctionCall3((type == BPCHAROID) ? bpchar : varchar,
+        dat, Int32GetDatum(typmod), BoolGetDatum(false));
+    if (c != dat) { /* padded: move to upper context */
+      Size n = VARSIZE(DatumGetPointer(c));
+      void *copy = SPI_palloc(n);
+      memcpy(copy, DatumGetPointer(c), n);
+      pfree(DatumGetPointer(c));
+      pfree(DatumGetPointer(dat));
+      dat = PointerGetDatum(copy);
+    }
+  }
+  return dat;
+}
+
 /* ======= Trigger ======= */
 
-static void luaP_preptrigger (lua_State *L, TriggerData *tdata) {
-  const char *relname;
-  char *namespace;
+/* relation tables are dropped when the relcache entry or any namespace is
+ * invalidated; each state compares the count with the one it last saw, and
+ * if it is one behind only relinval_relid is dropped. Only invalidations of
+ * relations in relinval_cached, the ones with tables in some state, count */
+static uint32 relinval_count = 0;
+static Oid relinval_relid = InvalidOid;
+static Oid *relinval_cached = NULL;
+static int relinval_ncached = 0;
+static int relinval_maxcached = 0;
+
+static void luaP_relcachecb (Datum arg, Oid relid) {
+  if (OidIsValid(relid)) { /* single relation? */
+    int i;
+    for (i = 0; i < relinval_ncached; i++)
+      if (relinval_cached[i] == relid) break;
+    if (i == relinval_ncached) return; /* not cached */
+    relinval_cached[i] = relinval_cached[--relinval_ncached];
+  }
+  relinval_count++;
+  relinval_relid = relid;
+}
+
+static void luaP_noterel (Oid relid) {
+  int i;
+  for (i = 0; i < relinval_ncached; i++)
+    if (relinval_cached[i] == relid) return;
+  if (relinval_ncached == relinval_maxcached) {
+    relinval_maxcached = (relinval_maxcached > 0) ?
+      2 * relinval_maxcached : 16;
+    relinval_cached = (relinval_cached == NULL) ?
+      (Oid *) MemoryContextAlloc(TopMemoryContext,
+          relinval_maxcached * sizeof(Oid)) :
+      (Oid *) repalloc(relinval_cached, relinval_maxcached * sizeof(Oid));
+  }
+  relinval_cached[relinval_ncached++] = relid;
+}
 
-  lua_pushglobaltable(L);
-  lua_pushstring(L, PLLUA_TRIGGERVAR);
-  lua_newtable(L);
+#if PG_VERSION_NUM >= 90200
+static void luaP_nspcachecb (Datum arg, int cacheid, uint32 hashvalue) {
+#else
+static void luaP_nspcachecb (Datum arg, int cacheid, ItemPointer tuplePtr) {
+#endif
+  relinval_count++;
+  relinval_relid = InvalidOid;
+}
+
+static void luaP_checkreltables (lua_State *L) {
+  uint32 seen;
+  luaP_getfield(L, PLLUA_RELINVAL);
+  seen = (uint32) lua_tonumber(L, -1);
+  lua_pop(L, 1);
+  if (seen == relinval_count) return;
+  if (seen + 1 == relinval_count && OidIsValid(relinval_relid)) {
+    lua_pushnil(L);
+    luaP_setoidcache(L, PLLUA_RELTABLES, relinval_relid);
+  }
+  else { /* drop all */
+    lua_pushlightuserdata(L, (void *) PLLUA_RELTABLES);
+    lua_newtable(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+  }
+  lua_pushlightuserdata(L, (void *) PLLUA_RELINVAL);
+  lua_pushnumber(L, (lua_Number) relinval_count);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+/* pushes relation table of rel, cached until rel is invalidated */
+static void luaP_pushreltable (lua_State *L, Relation rel) {
+  luaP_checkreltables(L);
+  luaP_getoidcache(L, PLLUA_RELTABLES, rel->rd_id);
+  if (lua_isnil(L, -1)) { /* not cached? */
+    char *namespace = get_namespace_name(rel->rd_rel->relnamespace);
+    lua_pop(L, 1); /* nil */
+    lua_createtable(L, 0, 4);
+    lua_pushstring(L, NameStr(rel->rd_rel->relname));
+    lua_setfield(L, -2, "name");
+    luaP_pushdesctable(L, rel->rd_att);
+    lua_pushvalue(L, -1); /* attribute table */
+    luaP_setoidcache(L, PLLUA_RELATIONS, rel->rd_id);
+    lua_setfield(L, -2, "attributes");
+    lua_pushinteger(L, (int) rel->rd_id);
+    lua_setfield(L, -2, "oid");
+    lua_pushstring(L, namespace);
+    lua_setfield(L, -2, "namespace");
+    if (namespace != NULL) pfree(namespace);
+    lua_pushvalue(L, -1);
+    luaP_setoidcache(L, PLLUA_RELTABLES, rel->rd_id);
+    luaP_noterel(rel->rd_id);
+  }
+}
+
+/* rows of the trigger call are anchored at rowrefs until released */
+static void luaP_preptrigger (lua_State *L, TriggerData *tdata,
+    int *rowrefs) {
+  /* reuse trigger table unless it is in use by an outer trigger */
+  lua_getglobal(L, PLLUA_TRIGGERVAR);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    luaP_getfield(L, PLLUA_TRIGGERTABLE);
+    /* clear fields set by the previous call, user-added ones included */
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      lua_pop(L, 1); /* value */
+      lua_pushvalue(L, -1);
+      lua_pushnil(L);
+      lua_rawset(L, -4);
+    }
+  }
+  else {
+    lua_pop(L, 1);
+    lua_createtable(L, 0, 9);
+  }
   /* when */
   if (TRIGGER_FIRED_BEFORE(tdata->tg_event))
-    lua_pushstring(L, "before");
+    lua_pushliteral(L, "before");
   else if (TRIGGER_FIRED_AFTER(tdata->tg_event))
-    lua_pushstring(L, "after");
+    lua_pushliteral(L, "after");
   else
     elog(ERROR, "[pllua]: unknown trigger 'when' event");
   lua_setfield(L, -2, "when");
   /* level */
   if (TRIGGER_FIRED_FOR_ROW(tdata->tg_event))
-    lua_pushstring(L, "row");
+    lua_pushliteral(L, "row");
   else if (TRIGGER_FIRED_FOR_STATEMENT(tdata->tg_event))
-    lua_pushstring(L, "statement");
+    lua_pushliteral(L, "statement");
   else
     elog(ERROR, "[pllua]: unknown trigger 'level' event");
   lua_setfield(L, -2, "level");
   /* operation */
   if (TRIGGER_FIRED_BY_INSERT(tdata->tg_event))
-    lua_pushstring(L, "insert");
+    lua_pushliteral(L, "insert");
   else if (TRIGGER_FIRED_BY_UPDATE(tdata->tg_event))
-    lua_pushstring(L, "update");
+    lua_pushliteral(L, "update");
   else if (TRIGGER_FIRED_BY_DELETE(tdata->tg_event))
-    lua_pushstring(L, "delete");
+    lua_pushliteral(L, "delete");
 #if PG_VERSION_NUM >= 80400
   else if (TRIGGER_FIRED_BY_TRUNCATE(tdata->tg_event))
-    lua_pushstring(L, "truncate");
+    lua_pushliteral(L, "truncate");
 #endif
   else
     elog(ERROR, "[pllua]: unknown trigger 'operation' event");
   lua_setfield(L, -2, "operation");
 
   /* relation */
-  relname = NameStr(tdata->tg_relation->rd_rel->relname);
-  namespace = get_namespace_name(tdata->tg_relation->rd_rel->relnamespace);
-
-  lua_createtable(L, 0, 3);
-  lua_pushstring(L, relname);
-  lua_setfield(L, -2, "name");
-  luaP_pushdesctable(L, tdata->tg_relation->rd_att);
-  lua_push_oidstring(L, (int) tdata->tg_relation->rd_id);
-  lua_pushvalue(L, -2); /* attribute table */
-
-  lua_rawset(L, LUA_REGISTRYINDEX); /* cache desc */
-  lua_setfield(L, -2, "attributes");
-  lua_pushinteger(L, (int) tdata->tg_relation->rd_id);
-  lua_setfield(L, -2, "oid");
-  lua_pushstring(L, namespace);
-  lua_setfield(L, -2, "namespace");
-
+  luaP_pushreltable(L, tdata->tg_relation);
   lua_setfield(L, -2, "relation");
 
   /* row */
@@ -297,23 +769,53 @@ static void luaP_preptrigger (lua_State *L, TriggerData *tdata) {
     if (TRIGGER_FIRED_BY_UPDATE(tdata->tg_event)) {
       luaP_pushtuple_trg(L, tdata->tg_relation->rd_att, tdata->tg_newtuple,
           tdata->tg_relation->rd_id, 0);
+      lua_pushvalue(L, -1);
+      rowrefs[0] = luaL_ref(L, LUA_REGISTRYINDEX);
       lua_setfield(L, -2, "row"); /* new row */
       luaP_pushtuple_trg(L, tdata->tg_relation->rd_att, tdata->tg_trigtuple,
           tdata->tg_relation->rd_id, 1);
+      lua_pushvalue(L, -1);
+      rowrefs[1] = luaL_ref(L, LUA_REGISTRYINDEX);
       lua_setfield(L, -2, "old"); /* old row */
     }
     else { /* insert or delete */
       luaP_pushtuple_trg(L, tdata->tg_relation->rd_att, tdata->tg_trigtuple,
           tdata->tg_relation->rd_id, 0);
+      lua_pushvalue(L, -1);
+      rowrefs[0] = luaL_ref(L, LUA_REGISTRYINDEX);
       lua_setfield(L, -2, "row"); /* old row */
+      lua_pushnil(L);
+      lua_setfield(L, -2, "old");
     }
   }
+  else {
+    lua_pushnil(L);
+    lua_setfield(L, -2, "row");
+    lua_pushnil(L);
+    lua_setfield(L, -2, "old");
+  }
+#if PG_VERSION_NUM >= 100000
+  /* transition tables, registered with SPI by the call handler */
+  if (tdata->tg_newtable != NULL && tdata->tg_trigger->tgnewtable != NULL)
+    luaP_pushtransition(L, tdata->tg_trigger->tgnewtable);
+  else
+    lua_pushnil(L);
+  lua_setfield(L, -2, "new_table");
+  if (tdata->tg_oldtable != NULL && tdata->tg_trigger->tgoldtable != NULL)
+    luaP_pushtransition(L, tdata->tg_trigger->tgoldtable);
+  else
+    lua_pushnil(L);
+  lua_setfield(L, -2, "old_table");
+#endif
   /* trigger name */
   lua_pushstring(L, tdata->tg_trigger->tgname);
   lua_setfield(L, -2, "name");
   /* done setting up trigger; now set global */
+  lua_pushglobaltable(L);
+  lua_pushstring(L, PLLUA_TRIGGERVAR);
+  lua_pushvalue(L, -3); /* table */
   lua_rawset(L, -3); /* _G[PLLUA_TRIGGERVAR] = table */
-  lua_pop(L, 1); /* _G */
+  lua_pop(L, 2); /* _G, table */
 }
 
 static Datum luaP_gettriggerresult (lua_State *L) {
@@ -325,10 +827,34 @@ static Datum luaP_gettriggerresult (lua_State *L) {
   return PointerGetDatum(tuple);
 }
 
+/* trigger tuples are freed by the executor when the call returns, so rows
+ * that escape it must not refer to them anymore */
+static void luaP_releaserows (lua_State *L, int *rowrefs) {
+  int i;
+  for (i = 0; i < 2; i++) {
+    if (rowrefs[i] == LUA_NOREF) continue;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, rowrefs[i]);
+    luaP_releasetuple(L, -1);
+    lua_pop(L, 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, rowrefs[i]);
+    rowrefs[i] = LUA_NOREF;
+  }
+}
+
 static void luaP_cleantrigger (lua_State *L) {
   rtds_tryclean(rtds_get_current()); //fi->functx;
   lua_pushglobaltable(L);
   lua_pushstring(L, PLLUA_TRIGGERVAR);
+  lua_rawget(L, -2);
+  luaP_getfield(L, PLLUA_TRIGGERTABLE);
+  if (lua_rawequal(L, -1, -2)) { /* reused table: release rows */
+    lua_pushnil(L);
+    lua_setfield(L, -2, "row");
+    lua_pushnil(L);
+    lua_setfield(L, -2, "old");
+  }
+  lua_pop(L, 2);
+  lua_pushstring(L, PLLUA_TRIGGERVAR);
   lua_pushnil(L);
   lua_rawset(L, -3);
   lua_pop(L, 1); /* _G */
@@ -470,6 +996,99 @@ static int luaP_fromstring (lua_State *L) {
     return 1;
 }
 
+/* ======= Allocator ======= */
+
+/* Lua heap: allocations go to a child of the state's memory context so that
+ * they are visible to MemoryContextStats and can be limited. LuaJIT keeps its
+ * own allocator, as 64-bit builds without GC64 need memory in the low 2GB,
+ * so pllua.max_memory does not apply there */
+typedef struct luaP_Heap {
+  MemoryContext mcxt;
+  Size used; /* bytes, as seen by Lua */
+  Size peak;
+  bool limited; /* enforce pllua.max_memory? */
+} luaP_Heap;
+
+#ifndef PLLUA_LUAJIT
+static void *luaP_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  luaP_Heap *h = (luaP_Heap *) ud;
+  Size oldsize = (ptr == NULL) ? 0 : osize; /* osize is a type tag in 5.2+ */
+  void *p;
+  if (nsize == 0) { /* free? */
+    if (ptr != NULL) {
+#if PG_VERSION_NUM >= 90500
+      pfree(ptr);
+#else
+      free(ptr);
+#endif
+      h->used -= oldsize;
+    }
+    return NULL;
+  }
+  if (nsize <= oldsize) { /* shrinking never fails */
+    h->used -= oldsize - nsize;
+    return ptr;
+  }
+  if (h->limited && pllua_max_memory > 0
+      && h->used + (nsize - oldsize) > (Size) pllua_max_memory * 1024)
+    return NULL; /* Lua raises a memory error */
+  /* must not ereport from here: Lua state would be left inconsistent */
+#if PG_VERSION_NUM >= 90500
+  p = MemoryContextAllocExtended(h->mcxt, nsize,
+      MCXT_ALLOC_HUGE | MCXT_ALLOC_NO_OOM);
+  if (p == NULL) return NULL;
+  if (ptr != NULL) {
+    memcpy(p, ptr, oldsize);
+    pfree(ptr);
+  }
+#else
+  p = realloc(ptr, nsize);
+  if (p == NULL) return NULL;
+#endif
+  h->used += nsize - oldsize;
+  if (h->used > h->peak) h->peak = h->used;
+  return p;
+}
+#endif
+
+/* pllua.max_memory only applies while Lua code runs in a protected call: a
+ * memory error in unprotected API calls, such as pushing arguments or
+ * converting results, would reach luaP_panic; returns previous setting */
+static bool luaP_setlimited (lua_State *L, bool limited) {
+#ifdef PLLUA_LUAJIT
+  (void) L;
+  (void) limited;
+  return false;
+#else
+  void *ud;
+  luaP_Heap *h;
+  bool prev;
+  lua_getallocf(L, &ud);
+  h = (luaP_Heap *) ud;
+  prev = h->limited;
+  h->limited = limited;
+  return prev;
+#endif
+}
+
+/* memusage() returns bytes used by Lua state and peak usage; peak is nil
+ * with LuaJIT */
+static int luaP_memusage (lua_State *L) {
+#ifdef PLLUA_LUAJIT
+  lua_pushnumber(L, (lua_Number) lua_gc(L, LUA_GCCOUNT, 0) * 1024
+      + lua_gc(L, LUA_GCCOUNTB, 0));
+  lua_pushnil(L);
+#else
+  void *ud;
+  luaP_Heap *h;
+  lua_getallocf(L, &ud);
+  h = (luaP_Heap *) ud;
+  lua_pushnumber(L, (lua_Number) h->used);
+  lua_pushnumber(L, (lua_Number) h->peak);
+#endif
+  return 2;
+}
+
 #ifdef PLLUA_DEBUG
 static int
 luaP_memstat(lua_State *L)
@@ -486,6 +1105,7 @@ static const luaL_Reg luaP_funcs[] = {
     {"fromstring", luaP_fromstring},
     {"info", luaP_info},
     {"log", luaP_log},
+    {"memusage", luaP_memusage},
 #ifdef PLLUA_DEBUG
     {"memstat", luaP_memstat},
 #endif
@@ -496,22 +1116,23 @@ static const luaL_Reg luaP_funcs[] = {
     {"setshared", luaP_setshared},
     {"subtransaction", use_subtransaction},
     {"warning", luaP_warning},
+    {"writer", luaP_newwriter},
     {"xpcall", subt_luaB_xpcall},
     {NULL, NULL}
 };
 
 void luaP_close (lua_State *L) {
   MemoryContext mcxt = luaP_getmemctxt(L);
+  lua_close(L); /* finalizers still use mcxt; heap is freed with it */
   MemoryContextDelete(mcxt);
-  lua_close(L);
 }
 
-lua_State *luaP_newstate (int trusted) {
-  int status;
+static bool relcache_registered = false;
 
+/* sets up new state L using memory context mcxt */
+static void luaP_initstate (lua_State *L, MemoryContext mcxt, int trusted) {
+  int status;
 
-  MemoryContext mcxt = pg_create_context("PL/Lua context");
-  lua_State *L = luaL_newstate();
   lua_atpanic(L, luaP_panic);
   /* version */
   lua_pushliteral(L, PLLUA_VERSION);
@@ -524,6 +1145,30 @@ lua_State *luaP_newstate (int trusted) {
   lua_pushlightuserdata(L, p_lua_master_state);
   lua_pushlightuserdata(L, (void *) L);
   lua_rawset(L, LUA_REGISTRYINDEX);
+  /* oid caches */
+  lua_pushlightuserdata(L, (void *) PLLUA_FUNCTIONS);
+  lua_newtable(L);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  lua_pushlightuserdata(L, (void *) PLLUA_TYPES);
+  lua_newtable(L);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  lua_pushlightuserdata(L, (void *) PLLUA_RELATIONS);
+  lua_newtable(L);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  lua_pushlightuserdata(L, (void *) PLLUA_RELTABLES);
+  lua_newtable(L);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  lua_pushlightuserdata(L, (void *) PLLUA_RELINVAL);
+  lua_pushnumber(L, (lua_Number) relinval_count);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  lua_pushlightuserdata(L, (void *) PLLUA_TRIGGERTABLE);
+  lua_createtable(L, 0, 9);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  if (!relcache_registered) {
+    CacheRegisterRelcacheCallback(luaP_relcachecb, (Datum) 0);
+    CacheRegisterSyscacheCallback(NAMESPACEOID, luaP_nspcachecb, (Datum) 0);
+    relcache_registered = true;
+  }
 
   /* core libs */
   if (trusted) {
@@ -577,6 +1222,7 @@ lua_State *luaP_newstate (int trusted) {
   register_error_mt(L);
   register_funcinfo_mt(L);
   register_int64(L);
+  register_numeric(L);
   /* setup typeinfo and raw datum MTs */
   lua_pushlightuserdata(L, (void *) PLLUA_TYPEINFO);
   lua_newtable(L); /* luaP_Typeinfo MT */
@@ -594,6 +1240,8 @@ lua_State *luaP_newstate (int trusted) {
   lua_setfield(L, -2, "save");
   lua_setfield(L, -2, "__index");
   lua_rawset(L, LUA_REGISTRYINDEX);
+  luaP_registerarray(L, trusted);
+  luaP_registerstream(L);
   /* load pllua.init modules */
   status = luaP_modinit(L);
   if (status != 0) /* SPI or module loading error? */
@@ -638,12 +1286,48 @@ lua_State *luaP_newstate (int trusted) {
     lua_setmetatable(L, -2);
     lua_pop(L, 1); /* _G */
   }
+}
+
+lua_State *luaP_newstate (int trusted) {
+  lua_State *L;
+  MemoryContext oldcxt = CurrentMemoryContext;
+  MemoryContext mcxt = pg_create_context("PL/Lua context");
+#ifdef PLLUA_LUAJIT
+  L = luaL_newstate();
+#else
+  luaP_Heap *h = (luaP_Heap *) MemoryContextAlloc(mcxt, sizeof(luaP_Heap));
+  h->mcxt = pg_create_subcontext(mcxt, "PL/Lua heap");
+  h->used = h->peak = 0;
+  h->limited = false; /* set by luaP_setlimited around calls */
+  L = lua_newstate(luaP_alloc, h);
+#endif
+  if (L == NULL) {
+    MemoryContextDelete(mcxt);
+    elog(ERROR, "[pllua]: could not create Lua state");
+  }
+  /* states are created on first use, so one that fails to initialize, for
+   * instance in a pllua.init module, is freed and built again next time */
+  PG_TRY();
+  {
+    luaP_initstate(L, mcxt, trusted);
+  }
+  PG_CATCH();
+  {
+    MemoryContextSwitchTo(oldcxt);
+    lua_close(L);
+    MemoryContextDelete(mcxt);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
   return L;
 }
 
 
 /* ======= luaP_pushfunction ======= */
 
+static void luaP_initconv (luaP_Conv *c, Oid type, luaP_Typeinfo *ti);
+static void luaP_registerarray (lua_State *L, int trusted);
+
 static luaP_Info *luaP_newinfo (lua_State *L, int nargs, int oid,
     Form_pg_proc procst) {
   Oid *argtype = procst->proargtypes.values;
@@ -657,7 +1341,7 @@ static luaP_Info *luaP_newinfo (lua_State *L, int nargs, int oid,
                        &&(rettype == INTERNALOID));
 
 
-  fi = lua_newuserdata(L, sizeof(luaP_Info) + nargs * sizeof(Oid));
+  fi = lua_newuserdata(L, sizeof(luaP_Info) + nargs * sizeof(luaP_Conv));
   fi->funcxt_wp = NULL;
   fi->oid = oid;
   fi->code_storage = code_storage;
@@ -670,7 +1354,7 @@ static luaP_Info *luaP_newinfo (lua_State *L, int nargs, int oid,
               (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
                errmsg("[pllua]: functions cannot take type '%s'",
               format_type_be(argtype[i]))));
-        fi->arg[i] = argtype[i];
+        luaP_initconv(&fi->arg[i], argtype[i], ti);
       }
       /* read result type */
       ti = luaP_gettypeinfo(L, rettype);
@@ -679,8 +1363,10 @@ static luaP_Info *luaP_newinfo (lua_State *L, int nargs, int oid,
             (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
              errmsg("[pllua]: functions cannot return type '%s'",
                format_type_be(rettype))));
+      luaP_initconv(&fi->rconv, rettype, ti);
   }else{
-      fi->arg[0] = INTERNALOID;
+      luaP_initconv(&fi->arg[0], INTERNALOID, NULL);
+      luaP_initconv(&fi->rconv, rettype, NULL);
   }
   fi->vararg = rettype == TRIGGEROID; /* triggers are vararg */
   fi->result = rettype;
@@ -701,6 +1387,8 @@ static void luaP_newfunction (lua_State *L, int oid, HeapTuple proc,
   text *t;
   luaL_Buffer b;
   int init = (*fi == NULL); /* not initialized? */
+  int status;
+  bool limited;
   const char *chunk_name = NULL;//PLLUA_CHUNKNAME;
   /* read proc info */
   procst = (Form_pg_proc) GETSTRUCT(proc);
@@ -708,10 +1396,8 @@ static void luaP_newfunction (lua_State *L, int oid, HeapTuple proc,
   if (isnull) elog(ERROR, "[pllua]: null prosrc");
   nargs = procst->pronargs;
   /* get info userdata */
-  if (init) {
-    lua_push_oidstring(L, oid);
+  if (init)
     *fi = luaP_newinfo(L, nargs, oid, procst);
-  }
   lua_pushlightuserdata(L, (void *) *fi);
   /* check #argnames */
   if ((nargs > 0)&&((*fi)->code_storage == 0)) {
@@ -773,16 +1459,23 @@ static void luaP_newfunction (lua_State *L, int oid, HeapTuple proc,
 #endif
 
 
-  if (luaL_loadbuffer(L, source, strlen(source), chunk_name))
-    luapg_error(L, "compile");
+  if (!(pllua_bytecode_cache && bcache_load(L, oid, proc, chunk_name))) {
+    if (luaL_loadbuffer(L, source, strlen(source), chunk_name))
+      luapg_error(L, "compile");
+    if (pllua_bytecode_cache)
+      bcache_store(L, oid, proc);
+  }
   lua_remove(L, -2); /* source */
-  if (lua_pcall(L, 0, 1, 0)) luapg_error(L, "call");
+  limited = luaP_setlimited(L, true);
+  status = lua_pcall(L, 0, 1, 0);
+  luaP_setlimited(L, limited);
+  if (status) luapg_error(L, "call");
   rowstamp_set(&(*fi)->stamp, proc); /* row-stamp info */
   lua_pushvalue(L, -1); /* func */
   if (init) {
-    lua_insert(L, -5);
+    lua_insert(L, -4);
     lua_rawset(L, LUA_REGISTRYINDEX); /* REG[light_info] = func */
-    lua_rawset(L, LUA_REGISTRYINDEX); /* REG[oid] = info */
+    luaP_setoidcache(L, PLLUA_FUNCTIONS, oid); /* REG[FUNCTIONS][oid] = info */
   }
   else {
     lua_insert(L, -3);
@@ -797,8 +1490,7 @@ static luaP_Info *luaP_pushfunction (lua_State *L, int oid) {
   proc = SearchSysCache(PROCOID, ObjectIdGetDatum((Oid) oid), 0, 0, 0);
   if (!HeapTupleIsValid(proc))
     elog(ERROR, "[pllua]: cache lookup failed for function %u", (Oid) oid);
-  lua_push_oidstring(L, oid);
-  lua_rawget(L, LUA_REGISTRYINDEX);
+  luaP_getoidcache(L, PLLUA_FUNCTIONS, oid);
   if (lua_isnil(L, -1)) { /* not interned? */
     lua_pop(L, 1); /* nil */
     luaP_newfunction(L, oid, proc, &fi);
@@ -822,19 +1514,90 @@ static luaP_Info *luaP_pushfunction (lua_State *L, int oid) {
 
 /* ======= luaP_pushargs ======= */
 
-static void luaP_pusharray (lua_State *L, char **p, int ndims,
-    int *dims, int *lb, bits8 **bitmap, int *bitmask,
-    luaP_Typeinfo *ti, Oid typeelem) {
+#define luaP_isvectorelem(t) ((t) == BOOLOID || (t) == INT2OID \
+    || (t) == INT4OID || (t) == INT8OID || (t) == FLOAT4OID \
+    || (t) == FLOAT8OID)
+
+#ifdef PLLUA_FFI
+/* FFI element type of vector element type t, NULL if none */
+static const char *luaP_ctype (Oid t) {
+  switch (t) {
+    case BOOLOID: return "bool";
+    case INT2OID: return "int16_t";
+    case INT4OID: return "int32_t";
+    case INT8OID: return "int64_t";
+    case FLOAT4OID: return "float";
+    case FLOAT8OID: return "double";
+  }
+  return NULL;
+}
+#endif
+
+/* element loop of luaP_pushvector; d points to current element */
+#define luaP_vectorloop(ctype, push) \
+  for (i = 0; i < n; i++) { \
+    if (b == NULL || (*b & m) != 0) { /* not NULL? */ \
+      push; \
+      lua_rawseti(L, -2, lb + i); \
+      d += sizeof(ctype); \
+    } \
+    if (b != NULL && (m <<= 1) == 0x100) { /* advance bitmap pointer? */ \
+      b++; \
+      m = 1; \
+    } \
+  }
+
+/* pushes vector of fixed-width builtin type typeelem (see
+ * luaP_isvectorelem) without per-element dispatch */
+static void luaP_pushvector (lua_State *L, char **p, int n, int lb,
+    bits8 **bitmap, int *bitmask, Oid typeelem) {
+  char *d = *p;
+  bits8 *b = *bitmap;
+  int m = *bitmask;
   int i;
-  lua_newtable(L);
-  if (ndims == 1) { /* vector? */
-    for (i = 0; i < (*dims); i++) {
-      if (*bitmap == NULL || ((**bitmap) & (*bitmask)) != 0) { /* not NULL? */
-        luaP_pushdatum(L, fetch_att(*p, ti->byval, ti->len), typeelem);
-        lua_rawseti(L, -2, (*lb) + i);
-        *p = att_addlength_pointer(*p, ti->len, *p);
-        *p = (char *) att_align_nominal(*p, ti->align);
-      }
+  lua_createtable(L, n, 0);
+  switch (typeelem) {
+    case BOOLOID:
+      luaP_vectorloop(bool, lua_pushboolean(L, *(bool *) d));
+      break;
+    case INT2OID:
+      luaP_vectorloop(int16, lua_pushinteger(L, (lua_Integer) *(int16 *) d));
+      break;
+    case INT4OID:
+      luaP_vectorloop(int32, lua_pushinteger(L, (lua_Integer) *(int32 *) d));
+      break;
+    case INT8OID:
+      luaP_vectorloop(int64, setInt64lua(L, *(int64 *) d));
+      break;
+    case FLOAT4OID:
+      luaP_vectorloop(float4, lua_pushnumber(L, (lua_Number) *(float4 *) d));
+      break;
+    case FLOAT8OID:
+      luaP_vectorloop(float8, lua_pushnumber(L, (lua_Number) *(float8 *) d));
+      break;
+  }
+  *p = d;
+  *bitmap = b;
+  *bitmask = m;
+}
+
+static void luaP_pusharray (lua_State *L, char **p, int ndims,
+    int *dims, int *lb, bits8 **bitmap, int *bitmask,
+    luaP_Typeinfo *ti, Oid typeelem) {
+  int i;
+  if (ndims == 1 && luaP_isvectorelem(typeelem)) {
+    luaP_pushvector(L, p, *dims, *lb, bitmap, bitmask, typeelem);
+    return;
+  }
+  lua_createtable(L, *dims, 0);
+  if (ndims == 1) { /* vector? */
+    for (i = 0; i < (*dims); i++) {
+      if (*bitmap == NULL || ((**bitmap) & (*bitmask)) != 0) { /* not NULL? */
+        luaP_pushdatum(L, fetch_att(*p, ti->byval, ti->len), typeelem);
+        lua_rawseti(L, -2, (*lb) + i);
+        *p = att_addlength_pointer(*p, ti->len, *p);
+        *p = (char *) att_align_nominal(*p, ti->align);
+      }
       if (*bitmap) { /* advance bitmap pointer? */
         *bitmask <<= 1;
         if (*bitmask == 0x100) {
@@ -853,6 +1616,255 @@ static void luaP_pusharray (lua_State *L, char **p, int ndims,
   }
 }
 
+/* ======= Array view ======= */
+
+static void luaP_pushelem (lua_State *L, luaP_Array *a, int i) {
+  int off;
+  if (a->stride > 0)
+    off = i * a->stride;
+  else {
+    if (a->offsets == NULL) { /* first access? */
+      bits8 *bitmap = ARR_NULLBITMAP(a->arr);
+      char *s = ARR_DATA_PTR(a->arr);
+      char *p = s;
+      int k;
+      a->offsets = (int32 *) MemoryContextAlloc(luaP_getmemctxt(L),
+          a->n * sizeof(int32));
+      for (k = 0; k < a->n; k++) {
+        if (bitmap != NULL && att_isnull(k, bitmap))
+          a->offsets[k] = -1;
+        else {
+          a->offsets[k] = p - s;
+          p = att_addlength_pointer(p, a->te->len, p);
+          p = (char *) att_align_nominal(p, a->te->align);
+        }
+      }
+    }
+    off = a->offsets[i];
+  }
+  if (off < 0)
+    lua_pushnil(L);
+  else
+    luaP_pushdatum(L, fetch_att(ARR_DATA_PTR(a->arr) + off, a->te->byval,
+        a->te->len), a->te->oid);
+}
+
+static luaP_Array *luaP_checkarray (lua_State *L, int narg) {
+  luaP_Array *a = luaP_toudata(L, narg, PLLUA_ARRAY);
+  if (a == NULL) {
+    const char *msg = lua_pushfstring(L, "%s expected, got %s",
+        PLLUA_ARRAY, luaL_typename(L, narg));
+    luaL_argerror(L, narg, msg);
+  }
+  return a;
+}
+
+static int luaP_arrayindex (lua_State *L) {
+  luaP_Array *a = luaP_checkarray(L, 1);
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    int i = lua_tointeger(L, 2) - a->lb;
+    if (i < 0 || i >= a->n) lua_pushnil(L);
+    else luaP_pushelem(L, a, i);
+  }
+  else { /* method */
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+  }
+  return 1;
+}
+
+static int luaP_arraylen (lua_State *L) {
+  luaP_Array *a = luaP_checkarray(L, 1);
+  lua_pushinteger(L, a->n);
+  return 1;
+}
+
+static int luaP_arraytostring (lua_State *L) {
+  luaP_Array *a = luaP_checkarray(L, 1);
+  lua_pushstring(L, OutputFunctionCall(&a->ti->output,
+        PointerGetDatum(a->arr)));
+  return 1;
+}
+
+static int luaP_arraygc (lua_State *L) {
+  luaP_Array *a = lua_touserdata(L, 1);
+  if (a->arr != NULL) pfree(a->arr);
+  if (a->offsets != NULL) pfree(a->offsets);
+  return 0;
+}
+
+static int luaP_arraynext (lua_State *L) {
+  luaP_Array *a = luaP_checkarray(L, 1);
+  lua_Integer k = luaL_checkinteger(L, 2) + 1;
+  luaL_argcheck(L, k >= a->lb, 2, "subscript out of range");
+  if (k - a->lb >= a->n) return 0;
+  lua_pushinteger(L, k);
+  luaP_pushelem(L, a, (int) (k - a->lb));
+  return 2;
+}
+
+/* a:ipairs() iterates over all subscripts, nulls included */
+static int luaP_arrayipairs (lua_State *L) {
+  luaP_Array *a = luaP_checkarray(L, 1);
+  lua_pushcfunction(L, luaP_arraynext);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, a->lb - 1);
+  return 3;
+}
+
+/* a:slice(i [, j]) returns table of elements i to j, indexed from 1 */
+static int luaP_arrayslice (lua_State *L) {
+  luaP_Array *a = luaP_checkarray(L, 1);
+  int i = (int) luaL_checkinteger(L, 2) - a->lb;
+  int j = (int) luaL_optinteger(L, 3, a->lb + a->n - 1) - a->lb;
+  int k;
+  if (i < 0) i = 0;
+  if (j >= a->n) j = a->n - 1;
+  lua_createtable(L, (j >= i) ? j - i + 1 : 0, 0);
+  for (k = i; k <= j; k++) {
+    luaP_pushelem(L, a, k);
+    lua_rawseti(L, -2, k - i + 1);
+  }
+  return 1;
+}
+
+/* a:totable() converts view as if it was not enabled */
+static int luaP_arraytotable (lua_State *L) {
+  luaP_Array *a = luaP_checkarray(L, 1);
+  char *p = ARR_DATA_PTR(a->arr);
+  bits8 *bitmap = ARR_NULLBITMAP(a->arr);
+  int bitmask = 1;
+  luaP_pusharray(L, &p, 1, &a->n, &a->lb, &bitmap, &bitmask, a->te,
+      a->te->oid);
+  return 1;
+}
+
+#ifdef PLLUA_FFI
+/* a:cdata() copies elements to a new FFI array, indexed from 0 */
+static int luaP_arraycdata (lua_State *L) {
+  luaP_Array *a = luaP_checkarray(L, 1);
+  const char *ct = luaP_ctype(a->te->oid);
+  if (ct == NULL || ARR_HASNULL(a->arr))
+    return luaL_error(L,
+        "cdata needs an array of fixed-width numbers without nulls");
+  setCArraylua(L, ct, ARR_DATA_PTR(a->arr), a->n);
+  return 1;
+}
+#endif
+
+static void luaP_registerarray (lua_State *L, int trusted) {
+  const luaL_Reg methods[] = {
+    {"ipairs", luaP_arrayipairs},
+    {"slice", luaP_arrayslice},
+    {"totable", luaP_arraytotable},
+    {NULL, NULL}
+  };
+  lua_pushlightuserdata(L, (void *) PLLUA_ARRAY);
+  lua_newtable(L); /* luaP_Array MT */
+  lua_createtable(L, 0, 4);
+  luaP_register(L, methods);
+#ifdef PLLUA_FFI
+  if (!trusted) { /* FFI arrays are not bounds checked */
+    lua_pushcfunction(L, luaP_arraycdata);
+    lua_setfield(L, -2, "cdata");
+  }
+#endif
+  lua_pushcclosure(L, luaP_arrayindex, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, luaP_arraylen);
+  lua_setfield(L, -2, "__len");
+  lua_pushcfunction(L, luaP_arrayipairs);
+  lua_setfield(L, -2, "__ipairs");
+  lua_pushcfunction(L, luaP_arraytostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushcfunction(L, luaP_arraygc);
+  lua_setfield(L, -2, "__gc");
+  lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+/* pushes view of detoasted array arr of type ti; array is copied to Lua
+ * memory context, so view can outlive the call */
+static void luaP_pusharrayview (lua_State *L, ArrayType *arr,
+    luaP_Typeinfo *ti) {
+  luaP_Array *a = lua_newuserdata(L, sizeof(luaP_Array));
+  a->arr = NULL;
+  a->offsets = NULL;
+  a->ti = ti;
+  a->te = luaP_gettypeinfo(L, ti->elem);
+  lua_pushlightuserdata(L, (void *) PLLUA_ARRAY);
+  lua_rawget(L, LUA_REGISTRYINDEX); /* Array_MT */
+  lua_setmetatable(L, -2);
+  a->arr = (ArrayType *) MemoryContextAlloc(luaP_getmemctxt(L),
+      VARSIZE(arr));
+  memcpy(a->arr, arr, VARSIZE(arr));
+  a->n = ArrayGetNItems(ARR_NDIM(a->arr), ARR_DIMS(a->arr));
+  a->lb = (ARR_NDIM(a->arr) > 0) ? ARR_LBOUND(a->arr)[0] : 1;
+  a->stride = (a->te->len > 0 && !ARR_HASNULL(a->arr)) ?
+    att_align_nominal(a->te->len, a->te->align) : 0;
+}
+
+/* pushes datum of non-builtin type described by ti */
+static void luaP_pushtyped (lua_State *L, Datum dat, Oid type,
+    luaP_Typeinfo *ti) {
+  switch (ti->type) {
+    case TYPTYPE_COMPOSITE: {
+      HeapTupleHeader tup = DatumGetHeapTupleHeader(dat);
+      HeapTupleData tuple;
+      int i;
+      /* deform in one pass; buffer is not reused until loop is done, as a
+       * composite type cannot contain itself */
+      tuple.t_len = HeapTupleHeaderGetDatumLength(tup);
+      ItemPointerSetInvalid(&(tuple.t_self));
+      tuple.t_tableOid = InvalidOid;
+      tuple.t_data = tup;
+      heap_deform_tuple(&tuple, ti->tupdesc, ti->values, ti->nulls);
+      lua_createtable(L, 0, ti->tupdesc->natts);
+      lua_rawgeti(L, LUA_REGISTRYINDEX, ti->attnames);
+      for (i = 0; i < ti->tupdesc->natts; i++) {
+        if (!ti->nulls[i] && !TupleDescAttr(ti->tupdesc, i)->attisdropped) {
+          lua_rawgeti(L, -1, i + 1); /* key */
+          luaP_pushdatum(L, ti->values[i],
+              TupleDescAttr(ti->tupdesc, i)->atttypid);
+          lua_rawset(L, -4);
+        }
+      }
+      lua_pop(L, 1); /* names */
+      break;
+    }
+    case TYPTYPE_PSEUDO:
+      if (type != VOIDOID) argerror(type);
+      break;
+    case TYPTYPE_BASE:
+    case TYPTYPE_DOMAIN:
+      if (ti->elem != 0 && ti->len == -1) { /* array? */
+        ArrayType *arr = DatumGetArrayTypeP(dat);
+        char *p = ARR_DATA_PTR(arr);
+        bits8 *bitmap = ARR_NULLBITMAP(arr);
+        int bitmask = 1;
+        luaP_Typeinfo *te;
+        if (pllua_array_views && ARR_NDIM(arr) <= 1) {
+          luaP_pusharrayview(L, arr, ti);
+          break;
+        }
+        te = luaP_gettypeinfo(L, ti->elem);
+        luaP_pusharray(L, &p, ARR_NDIM(arr), ARR_DIMS(arr), ARR_LBOUND(arr),
+            &bitmap, &bitmask, te, ti->elem);
+      }
+      else if (ti->base == NUMERICOID) /* domain over numeric */
+        push_numeric(L, dat);
+      else
+        luaP_pushrawdatum(L, dat, ti);
+      break;
+#if PG_VERSION_NUM >= 80300
+    case TYPTYPE_ENUM:
+      lua_pushinteger(L, (lua_Integer) DatumGetInt32(dat)); /* 4-byte long */
+      break;
+#endif
+    default:
+      argerror(type);
+  }
+}
+
 void luaP_pushdatum (lua_State *L, Datum dat, Oid type) {
   switch (type) {
     /* base and domain types */
@@ -874,14 +1886,14 @@ void luaP_pushdatum (lua_State *L, Datum dat, Oid type) {
     case INT8OID:
         setInt64lua(L,(DatumGetInt64(dat)));
         break;
-    case TEXTOID:
-      lua_pushstring(L, text2string(dat));
+    case NUMERICOID:
+      push_numeric(L, dat);
       break;
+    case TEXTOID:
     case BPCHAROID:
-      lua_pushstring(L, datum2string(dat, bpcharout));
-      break;
     case VARCHAROID:
-      lua_pushstring(L, datum2string(dat, varcharout));
+    case BYTEAOID:
+      luaP_pushvarlena(L, dat);
       break;
     case REFCURSOROID: {
       Portal cursor = SPI_cursor_find(text2string(dat));
@@ -892,53 +1904,8 @@ void luaP_pushdatum (lua_State *L, Datum dat, Oid type) {
     case RECORDOID:
       luaP_pushrecord(L, dat);
       break;
-    default: {
-      luaP_Typeinfo *ti;
-      ti = luaP_gettypeinfo(L, type);
-      switch (ti->type) {
-        case TYPTYPE_COMPOSITE: {
-          HeapTupleHeader tup = DatumGetHeapTupleHeader(dat);
-          int i;
-          const char *key;
-          bool isnull;
-          Datum value;
-          lua_createtable(L, 0, ti->tupdesc->natts);
-          for (i = 0; i < ti->tupdesc->natts; i++) {
-            key = NameStr(TupleDescAttr(ti->tupdesc, i)->attname);
-            value = GetAttributeByNum(tup, TupleDescAttr(ti->tupdesc, i)->attnum, &isnull);
-            if (!isnull) {
-              luaP_pushdatum(L, value, TupleDescAttr(ti->tupdesc, i)->atttypid);
-              lua_setfield(L, -2, key);
-            }
-          }
-          break;
-        }
-        case TYPTYPE_PSEUDO:
-          if (type != VOIDOID) argerror(type);
-          break;
-        case TYPTYPE_BASE:
-        case TYPTYPE_DOMAIN:
-          if (ti->elem != 0 && ti->len == -1) { /* array? */
-            ArrayType *arr = DatumGetArrayTypeP(dat);
-            char *p = ARR_DATA_PTR(arr);
-            bits8 *bitmap = ARR_NULLBITMAP(arr);
-            int bitmask = 1;
-            luaP_Typeinfo *te = luaP_gettypeinfo(L, ti->elem);
-            luaP_pusharray(L, &p, ARR_NDIM(arr), ARR_DIMS(arr), ARR_LBOUND(arr),
-                &bitmap, &bitmask, te, ti->elem);
-          }
-          else
-            luaP_pushrawdatum(L, dat, ti);
-          break;
-#if PG_VERSION_NUM >= 80300
-        case TYPTYPE_ENUM:
-          lua_pushinteger(L, (lua_Integer) DatumGetInt32(dat)); /* 4-byte long */
-          break;
-#endif
-        default:
-          argerror(type);
-      }
-    }
+    default:
+      luaP_pushtyped(L, dat, type, luaP_gettypeinfo(L, type));
   }
 }
 
@@ -947,133 +1914,360 @@ static void luaP_pushargs (lua_State *L, FunctionCallInfo fcinfo,
   int i;
   for (i = 0; i < fcinfo->nargs; i++) {
     if (fcinfo->argnull[i]) lua_pushnil(L);
-    else luaP_pushdatum(L, fcinfo->arg[i], fi->arg[i]);
+    else fi->arg[i].push(L, fcinfo->arg[i], &fi->arg[i]);
   }
 }
 
 
 /* ======= luaP_getresult ======= */
 
-/* assume table is in top, returns size */
-static int luaP_getarraydims (lua_State *L, int *ndims, int *dims,
-    int *lb, luaP_Typeinfo *ti, Oid typeelem, int typmod, bool *hasnulls) {
-  int size = 0;
-  int nitems = 0;
-  *ndims = -1;
-  *hasnulls = false;
+/* structural pass over table at top: sets dims and lower bounds of each
+ * level and returns number of non-nil elements; no conversion is done */
+static int luaP_getarraydims (lua_State *L, int level, int *ndims, int *dims,
+    int *lb) {
+  int nelems = 0;
   lua_pushnil(L);
   while (lua_next(L, -2)) {
-    if (lua_isnumber(L, -2)) {
-      int n;
+    if (lua_type(L, -2) == LUA_TNUMBER) {
       int k = lua_tointeger(L, -2);
       /* set dims and lb */
-      if (*ndims < 0) { /* first visit? */
-        *lb = k;
-        *dims = 1;
+      if (dims[level] == 0) { /* first visit? */
+        lb[level] = k;
+        dims[level] = 1;
       }
       else {
-        if (*lb > k) {
-          *dims += *lb - k;
-          *lb = k;
+        if (lb[level] > k) {
+          dims[level] += lb[level] - k;
+          lb[level] = k;
         }
-        if (*dims - 1 + *lb < k) /* max < k? */
-          *dims = k - *lb + 1;
+        if (dims[level] - 1 + lb[level] < k) /* max < k? */
+          dims[level] = k - lb[level] + 1;
       }
-      /* set ndims */
-      if (lua_type(L, -1) == LUA_TTABLE) {
-        int d = -1, l = -1;
-        if (*ndims == MAXDIM)
+      if (lua_type(L, -1) == LUA_TTABLE) { /* subarray */
+        if (level + 1 == MAXDIM)
           elog(ERROR, "[pllua]: table exceeds max number of dimensions");
-        if (*ndims > 1) {
-          d = dims[1]; l = lb[1];
-        }
-        size += luaP_getarraydims(L, &n, dims + 1, lb + 1, ti, typeelem,
-            typmod, hasnulls);
-        if (*ndims > 1) { /* update dims and bounds? */
-          if (l < lb[1]) {
-            lb[1] = l;
-            *hasnulls = true;
-          }
-          if (d + l > dims[1] + lb[1]) {
-            dims[1] = d + l - lb[1];
-            *hasnulls = true;
-          }
-        }
+        nelems += luaP_getarraydims(L, level + 1, ndims, dims, lb);
+      }
+      else { /* element */
+        if (*ndims == 0) *ndims = level + 1;
+        else if (*ndims != level + 1)
+          elog(ERROR, "[pllua]: table is asymetric");
+        nelems++;
+      }
+    }
+    lua_pop(L, 1);
+  }
+  return nelems;
+}
+
+/* conversion pass: stores elements of table at top in values and nulls;
+ * nil entries, including whole subarrays, become nulls */
+static void luaP_toarray (lua_State *L, int level, int ndims, int *dims,
+    int *lb, Datum **values, bool **nulls, luaP_Typeinfo *te, Oid typeelem,
+    int typmod) {
+  int i;
+  for (i = 0; i < dims[level]; i++) {
+    lua_rawgeti(L, -1, lb[level] + i);
+    if (level == ndims - 1) { /* element? */
+      Datum d = luaP_todatum(L, typeelem, typmod, *nulls, -1);
+      if (!(**nulls) && te->len == -1) /* varlena? */
+        d = PointerGetDatum(PG_DETOAST_DATUM(d));
+      *(*values)++ = d;
+      (*nulls)++;
+    }
+    else if (lua_type(L, -1) == LUA_TTABLE)
+      luaP_toarray(L, level + 1, ndims, dims, lb, values, nulls, te,
+          typeelem, typmod);
+    else if (lua_isnil(L, -1)) { /* null subarray */
+      int j, n = 1;
+      for (j = level + 1; j < ndims; j++) n *= dims[j];
+      for (j = 0; j < n; j++) {
+        *(*values)++ = (Datum) 0;
+        *(*nulls)++ = true;
       }
+    }
+    else
+      elog(ERROR, "[pllua]: table is asymetric");
+    lua_pop(L, 1);
+  }
+}
+
+/* fast path for dense vectors of fixed-width builtin types: elements are
+ * stored straight into array data */
+static void luaP_tovector (lua_State *L, Oid typeelem, char *p, int lb,
+    int n) {
+  int i;
+  switch (typeelem) {
+    case BOOLOID:
+      for (i = 0; i < n; i++) {
+        lua_rawgeti(L, -1, lb + i);
+        ((bool *) p)[i] = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+      }
+      break;
+    case INT2OID:
+      for (i = 0; i < n; i++) {
+        lua_rawgeti(L, -1, lb + i);
+        ((int16 *) p)[i] = (int16) lua_tointeger(L, -1);
+        lua_pop(L, 1);
+      }
+      break;
+    case INT4OID:
+      for (i = 0; i < n; i++) {
+        lua_rawgeti(L, -1, lb + i);
+        ((int32 *) p)[i] = (int32) lua_tointeger(L, -1);
+        lua_pop(L, 1);
+      }
+      break;
+    case INT8OID:
+      for (i = 0; i < n; i++) {
+        lua_rawgeti(L, -1, lb + i);
+        ((int64 *) p)[i] = get64lua(L, -1);
+        lua_pop(L, 1);
+      }
+      break;
+    case FLOAT4OID:
+      for (i = 0; i < n; i++) {
+        lua_rawgeti(L, -1, lb + i);
+        ((float4 *) p)[i] = (float4) lua_tonumber(L, -1);
+        lua_pop(L, 1);
+      }
+      break;
+    case FLOAT8OID:
+      for (i = 0; i < n; i++) {
+        lua_rawgeti(L, -1, lb + i);
+        ((float8 *) p)[i] = (float8) lua_tonumber(L, -1);
+        lua_pop(L, 1);
+      }
+      break;
+  }
+}
+
+/* builds array of type ti from table at top; result is allocated in upper
+ * memory context */
+/* copies elements to the data area and null bitmap of zeroed array a and
+ * frees by-reference values, like CopyArrayEls, which is static before
+ * PostgreSQL 9.5 */
+static void luaP_copyarrayels (ArrayType *a, Datum *values, bool *nulls,
+    int nitems, luaP_Typeinfo *te) {
+  char *p = ARR_DATA_PTR(a);
+  bits8 *bitmap = ARR_NULLBITMAP(a);
+  int i;
+  for (i = 0; i < nitems; i++) {
+    int inc;
+    if (nulls[i]) continue; /* bit stays clear */
+    if (bitmap != NULL)
+      bitmap[i / BITS_PER_BYTE] |= 1 << (i % BITS_PER_BYTE);
+    if (te->byval) {
+      store_att_byval(p, values[i], te->len);
+      inc = te->len;
+    }
+    else {
+      inc = att_addlength_datum(0, te->len, values[i]);
+      memmove(p, DatumGetPointer(values[i]), inc);
+      pfree(DatumGetPointer(values[i]));
+    }
+    p += att_align_nominal(inc, te->align);
+  }
+}
+
+static ArrayType *luaP_makearray (lua_State *L, luaP_Typeinfo *ti,
+    int typmod) {
+  luaP_Typeinfo *te = luaP_gettypeinfo(L, ti->elem);
+  int ndims = 0, dims[MAXDIM], lb[MAXDIM];
+  int i, nitems, nelems;
+  ArrayType *a;
+  for (i = 0; i < MAXDIM; i++) dims[i] = lb[i] = 0;
+  nelems = luaP_getarraydims(L, 0, &ndims, dims, lb);
+  if (nelems == 0) { /* empty array? */
+    a = (ArrayType *) SPI_palloc(sizeof(ArrayType));
+    SET_VARSIZE(a, sizeof(ArrayType));
+    a->ndim = 0;
+    a->dataoffset = 0;
+    a->elemtype = ti->elem;
+    return a;
+  }
+  nitems = 1;
+  for (i = 0; i < ndims; i++) {
+    nitems *= dims[i];
+    if (nitems > MaxArraySize)
+      elog(ERROR, "[pllua]: array size exceeds maximum allowed");
+  }
+  if (ndims == 1 && nelems == nitems && luaP_isvectorelem(ti->elem)
+      && (Size) nitems * te->len <= MaxAllocSize - ARR_OVERHEAD_NONULLS(1)) {
+    int size = ARR_OVERHEAD_NONULLS(1) + nitems * te->len;
+    a = (ArrayType *) SPI_palloc(size);
+    SET_VARSIZE(a, size);
+    a->ndim = 1;
+    a->dataoffset = 0;
+    a->elemtype = ti->elem;
+    *ARR_DIMS(a) = dims[0];
+    *ARR_LBOUND(a) = lb[0];
+    luaP_tovector(L, ti->elem, ARR_DATA_PTR(a), lb[0], nitems);
+  }
+  else {
+    Datum *values = (Datum *) palloc(nitems * sizeof(Datum));
+    bool *nulls = (bool *) palloc(nitems * sizeof(bool));
+    Datum *v = values;
+    bool *n = nulls;
+    Size size = 0;
+    int offset = 0;
+    luaP_toarray(L, 0, ndims, dims, lb, &v, &n, te, ti->elem, typmod);
+    for (i = 0; i < nitems; i++) {
+      if (nulls[i])
+        offset = 1;
       else {
-        bool isnull;
-        Datum d = luaP_todatum(L, typeelem, typmod, &isnull, -1);
-        Pointer v = DatumGetPointer(d);
-        n = 0;
-        if (ti->len == -1) /* varlena? */
-          v = (Pointer) PG_DETOAST_DATUM(d);
-        size = att_addlength_pointer(size, ti->len, v);
-        size = att_align_nominal(size, ti->align);
+        size = att_addlength_datum(size, te->len, values[i]);
+        size = att_align_nominal(size, te->align);
         if (size > MaxAllocSize)
           elog(ERROR, "[pllua]: array size exceeds the maximum allowed");
       }
-      n++;
-      if (*ndims < 0) *ndims = n;
-      else if (*ndims != n) elog(ERROR, "[pllua]: table is asymetric");
     }
-    nitems++;
-    lua_pop(L, 1);
+    if (offset) {
+      offset = ARR_OVERHEAD_WITHNULLS(ndims, nitems);
+      size += offset;
+    }
+    else
+      size += ARR_OVERHEAD_NONULLS(ndims);
+    /* zeroed, as padding and null bitmap are not written in full */
+    a = (ArrayType *) SPI_palloc(size);
+    memset(a, 0, size);
+    SET_VARSIZE(a, size);
+    a->ndim = ndims;
+    a->dataoffset = offset;
+    a->elemtype = ti->elem;
+    memcpy(ARR_DIMS(a), dims, ndims * sizeof(int));
+    memcpy(ARR_LBOUND(a), lb, ndims * sizeof(int));
+    luaP_copyarrayels(a, values, nulls, nitems, te);
+    pfree(values);
+    pfree(nulls);
   }
-  if (!(*hasnulls)) *hasnulls = (nitems > 0 && nitems != *dims);
-  return size;
+  return a;
 }
 
-static void luaP_toarray (lua_State *L, char **p, int ndims,
-    int *dims, int *lb, bits8 **bitmap, int *bitmask, int *bitval,
-    luaP_Typeinfo *ti, Oid typeelem, int typmod) {
-  int i;
-  bool isnull;
-  if (ndims == 1) { /* vector? */
-    for (i = 0; i < (*dims); i++) {
-      Pointer v;
-      lua_rawgeti(L, -1, (*lb) + i);
-      v = DatumGetPointer(luaP_todatum(L, typeelem, typmod, &isnull, -1));
-      if (!isnull) {
-        *bitval |= *bitmask;
-        if (ti->len > 0) {
-          if (ti->byval)
-            store_att_byval(*p, PointerGetDatum(v), ti->len);
-          else
-            memmove(*p, v, ti->len);
-          *p += att_align_nominal(ti->len, ti->align);
+#ifdef PLLUA_FFI
+/* builds one-dimensional array of type ti from FFI array at idx; result is
+ * allocated in upper memory context */
+static ArrayType *luaP_cdatatoarray (lua_State *L, int idx,
+    luaP_Typeinfo *ti) {
+  const char *ct = luaP_ctype(ti->elem);
+  const void *p;
+  int n = getCArraylua(L, idx, ct, &p);
+  int16 len = luaP_gettypeinfo(L, ti->elem)->len;
+  Size size;
+  ArrayType *a;
+  if (n < 0)
+    elog(ERROR, "[pllua]: %s[?] cdata expected for array conversion", ct);
+  if ((Size) n * len > MaxAllocSize - ARR_OVERHEAD_NONULLS(1))
+    elog(ERROR, "[pllua]: array size exceeds the maximum allowed");
+  size = (n > 0) ? ARR_OVERHEAD_NONULLS(1) + n * len : sizeof(ArrayType);
+  a = (ArrayType *) SPI_palloc(size);
+  SET_VARSIZE(a, size);
+  a->ndim = (n > 0) ? 1 : 0;
+  a->dataoffset = 0;
+  a->elemtype = ti->elem;
+  if (n > 0) {
+    *ARR_DIMS(a) = n;
+    *ARR_LBOUND(a) = 1;
+    memcpy(ARR_DATA_PTR(a), p, n * len);
+  }
+  return a;
+}
+#endif
+
+/* converts non-null value at idx to datum of non-builtin type described by
+ * ti; result is allocated in upper memory context */
+static Datum luaP_totyped (lua_State *L, Oid type, int typmod,
+    luaP_Typeinfo *ti, int idx) {
+  Datum dat = 0;
+  switch (ti->type) {
+    case TYPTYPE_COMPOSITE:
+      if (lua_type(L, idx) == LUA_TTABLE) {
+        int i;
+        luaP_Buffer *b;
+        if (lua_type(L, idx) != LUA_TTABLE)
+          elog(ERROR, "[pllua]: table expected for record result, got %s",
+              lua_typename(L, lua_type(L, idx)));
+        /* create tuple */
+        b = luaP_getbuffer(L, ti->tupdesc->natts);
+        for (i = 0; i < ti->tupdesc->natts; i++) {
+
+          lua_getfield(L, idx, NameStr(TupleDescAttr(ti->tupdesc, i)->attname));
+          /* only simple types allowed in record */
+          b->value[i] = luaP_todatum(L, TupleDescAttr(ti->tupdesc, i)->atttypid,
+              TupleDescAttr(ti->tupdesc, i)->atttypmod, b->null + i, idx);
+          lua_pop(L, 1);
         }
-        else {
-          int inc;
-          Assert(!ti->byval);
-          inc = att_addlength_pointer(0, ti->len, v);
-          memmove(*p, v, inc);
-          *p += att_align_nominal(inc, ti->align);
+        /* make copy in upper executor memory context */
+        dat = PointerGetDatum(SPI_returntuple(heap_form_tuple(ti->tupdesc,
+                b->value, b->null), ti->tupdesc));
+      }
+      else { /* tuple */
+        HeapTuple tuple = luaP_casttuple(L, ti->tupdesc);
+        if (tuple == NULL)
+          elog(ERROR,
+              "[pllua]: table or tuple expected for record result, got %s",
+              lua_typename(L, lua_type(L, idx)));
+        dat = PointerGetDatum(SPI_returntuple(tuple, ti->tupdesc));
+      }
+      break;
+    case TYPTYPE_BASE:
+    case TYPTYPE_DOMAIN:
+      if (ti->elem != 0 && ti->len == -1) { /* array? */
+        luaP_Array *a = luaP_toudata(L, idx, PLLUA_ARRAY);
+        if (a != NULL) { /* view: pass array through */
+          Size l = VARSIZE(a->arr);
+          if (ARR_ELEMTYPE(a->arr) != ti->elem)
+            elog(ERROR, "[pllua]: array of type '%s' expected, got '%s'",
+                format_type_be(type), format_type_be(a->ti->oid));
+          dat = PointerGetDatum(SPI_palloc(l));
+          memcpy(DatumGetPointer(dat), a->arr, l);
+          break;
+        }
+#ifdef PLLUA_FFI
+        if (lua_type(L, idx) == LUA_TCDATA && luaP_ctype(ti->elem) != NULL) {
+          dat = PointerGetDatum(luaP_cdatatoarray(L, idx, ti));
+          break;
         }
-        if (!ti->byval) pfree(v);
+#endif
+        if (lua_type(L, idx) != LUA_TTABLE)
+          elog(ERROR,
+              "[pllua]: table expected for array conversion, got %s",
+              lua_typename(L, lua_type(L, idx)));
+        lua_pushvalue(L, idx);
+        dat = PointerGetDatum(luaP_makearray(L, ti, typmod));
+        lua_pop(L, 1);
       }
-      else
-        if (!(*bitmap))
-          elog(ERROR, "[pllua]: no support for null elements");
-      if (*bitmap) {
-        *bitmask <<= 1;
-        if (*bitmask == 0x100) {
-          *(*bitmap)++ = *bitval;
-          *bitval = 0;
-          *bitmask = 1;
+      else if (ti->base == NUMERICOID) { /* domain over numeric */
+        int32 basetypmod = -1;
+        if (ti->type != TYPTYPE_DOMAIN)
+          dat = get_numeric(L, idx, typmod);
+        else {
+          getBaseTypeAndTypmod(type, &basetypmod); /* typmod of domain */
+          dat = get_numeric(L, idx, basetypmod);
+#if PG_VERSION_NUM >= 90100
+          domain_check(dat, false, type, NULL, NULL);
+#endif
         }
       }
-      lua_pop(L, 1);
-    }
-    if (*bitmap && *bitmask != 1) **bitmap = *bitval;
-  }
-  else { /* multidimensional array */
-    for (i = 0; i < (*dims); i++) {
-      lua_rawgeti(L, -1, (*lb) + i);
-      luaP_toarray(L, p, ndims - 1, dims + 1, lb + 1, bitmap,
-          bitmask, bitval, ti, typeelem, typmod);
-      lua_pop(L, 1);
-    }
+      else {
+        luaP_Datum *d = luaP_toudata(L, idx, PLLUA_DATUM);
+        if (d == NULL) elog(ERROR,
+            "[pllua]: raw datum expected for datum conversion, got %s",
+            lua_typename(L, lua_type(L, idx)));
+        dat = datumcopy(d->datum, ti);
+      }
+      break;
+#if PG_VERSION_NUM >= 80300
+    case TYPTYPE_ENUM:
+      dat = Int32GetDatum(lua_tointeger(L, idx));
+      break;
+#endif
+    case TYPTYPE_PSEUDO:
+    default:
+      resulterror(type);
   }
+  return dat;
 }
 
 Datum luaP_todatum (lua_State *L, Oid type, int typmod, bool *isnull, int idx) {
@@ -1110,142 +2304,185 @@ Datum luaP_todatum (lua_State *L, Oid type, int typmod, bool *isnull, int idx) {
       }
 #endif
 
-      case TEXTOID: {
-        const char *s = lua_tostring(L, idx);
-        if (s == NULL) elog(ERROR,
-            "[pllua]: string expected for datum conversion, got %s",
-            lua_typename(L, lua_type(L, idx)));
-        dat = string2text(s);
+      case NUMERICOID:
+        dat = get_numeric(L, idx, typmod);
+        break;
+      case TEXTOID:
+      case BPCHAROID:
+      case VARCHAROID:
+      case BYTEAOID:
+        dat = luaP_tovarlena(L, type, typmod, idx);
         break;
-      }
       case REFCURSOROID: {
         Portal cursor = luaP_tocursor(L, idx);
-        dat = string2text(cursor->name);
+        dat = string2text(cursor->name, strlen(cursor->name));
         break;
       }
-      default: {
-        luaP_Typeinfo *ti;
-        ti = luaP_gettypeinfo(L, type);
-        switch (ti->type) {
-          case TYPTYPE_COMPOSITE:
-            if (lua_type(L, idx) == LUA_TTABLE) {
-              int i;
-              luaP_Buffer *b;
-              if (lua_type(L, idx) != LUA_TTABLE)
-                elog(ERROR, "[pllua]: table expected for record result, got %s",
-                    lua_typename(L, lua_type(L, idx)));
-              /* create tuple */
-              b = luaP_getbuffer(L, ti->tupdesc->natts);
-              for (i = 0; i < ti->tupdesc->natts; i++) {
-
-                lua_getfield(L, idx, NameStr(TupleDescAttr(ti->tupdesc, i)->attname));
-                /* only simple types allowed in record */
-                b->value[i] = luaP_todatum(L, TupleDescAttr(ti->tupdesc, i)->atttypid,
-                    TupleDescAttr(ti->tupdesc, i)->atttypmod, b->null + i, idx);
-                lua_pop(L, 1);
-              }
-              /* make copy in upper executor memory context */
-              dat = PointerGetDatum(SPI_returntuple(heap_form_tuple(ti->tupdesc,
-                      b->value, b->null), ti->tupdesc));
-            }
-            else { /* tuple */
-              HeapTuple tuple = luaP_casttuple(L, ti->tupdesc);
-              if (tuple == NULL)
-                elog(ERROR,
-                    "[pllua]: table or tuple expected for record result, got %s",
-                    lua_typename(L, lua_type(L, idx)));
-              dat = PointerGetDatum(SPI_returntuple(tuple, ti->tupdesc));
-            }
-            break;
-          case TYPTYPE_BASE:
-          case TYPTYPE_DOMAIN:
-            if (ti->elem != 0 && ti->len == idx) { /* array? */
-              luaP_Typeinfo *te;
-              int ndims, dims[MAXDIM], lb[MAXDIM];
-              int i, size;
-              bool hasnulls;
-              ArrayType *a;
-              if (lua_type(L, idx) != LUA_TTABLE)
-                elog(ERROR,
-                    "[pllua]: table expected for array conversion, got %s",
-                    lua_typename(L, lua_type(L, idx)));
-              te = luaP_gettypeinfo(L, ti->elem);
-              for (i = 0; i < MAXDIM; i++) dims[i] = lb[i] = idx;
-              size = luaP_getarraydims(L, &ndims, dims, lb, te, ti->elem,
-                  typmod, &hasnulls);
-              if (size == 0) { /* empty array? */
-                a = (ArrayType *) SPI_palloc(sizeof(ArrayType));
-                SET_VARSIZE(a, sizeof(ArrayType));
-                a->ndim = 0;
-                a->dataoffset = 0;
-                a->elemtype = ti->elem;
-              }
-              else {
-                int nitems = 1;
-                int offset;
-                char *p;
-                bits8 *bitmap;
-                int bitmask = 1;
-                int bitval = 0;
-                for (i = 0; i < ndims; i++) {
-                  nitems *= dims[i];
-                  if (nitems > MaxArraySize)
-                    elog(ERROR,
-                        "[pllua]: array size exceeds maximum allowed");
-                }
-                if (hasnulls) {
-                  offset = ARR_OVERHEAD_WITHNULLS(ndims, nitems);
-                  size += offset;
-                }
-                else {
-                  offset = 0;
-                  size += ARR_OVERHEAD_NONULLS(ndims);
-                }
-                a = (ArrayType *) SPI_palloc(size);
-                SET_VARSIZE(a, size);
-                a->ndim = ndims;
-                a->dataoffset = offset;
-                a->elemtype = ti->elem;
-                memcpy(ARR_DIMS(a), dims, ndims * sizeof(int));
-                memcpy(ARR_LBOUND(a), lb, ndims * sizeof(int));
-                p = ARR_DATA_PTR(a);
-                bitmap = ARR_NULLBITMAP(a);
-                luaP_toarray(L, &p, ndims, dims, lb, &bitmap, &bitmask,
-                    &bitval, te, ti->elem, typmod);
-              }
-              dat = PointerGetDatum(a);
-            }
-            else {
-              luaP_Datum *d = luaP_toudata(L, idx, PLLUA_DATUM);
-              if (d == NULL) elog(ERROR,
-                  "[pllua]: raw datum expected for datum conversion, got %s",
-                  lua_typename(L, lua_type(L, idx)));
-              dat = datumcopy(d->datum, ti);
-            }
-            break;
-#if PG_VERSION_NUM >= 80300
-          case TYPTYPE_ENUM:
-            dat = Int32GetDatum(lua_tointeger(L, idx));
-            break;
-#endif
-          case TYPTYPE_PSEUDO:
-          default:
-            resulterror(type);
-        }
-      }
+      default:
+        dat = luaP_totyped(L, type, typmod, luaP_gettypeinfo(L, type), idx);
     }
   }
   return dat;
 }
 
 static Datum luaP_getresult (lua_State *L, FunctionCallInfo fcinfo,
-    Oid type) {
-  Datum dat = luaP_todatum(L, type, 0, &fcinfo->isnull, -1);
+    luaP_Conv *c) {
+  Datum dat = c->to(L, c, &fcinfo->isnull, -1);
   lua_settop(L, 0);
   return dat;
 }
 
 
+/* ======= luaP_Conv ======= */
+
+/* converters are chosen once per function in luaP_initconv, so that calls
+ * skip type dispatch and typeinfo lookups */
+
+static void luaP_pushconv_bool (lua_State *L, Datum dat, luaP_Conv *c) {
+  lua_pushboolean(L, (int) (dat != 0));
+}
+
+static void luaP_pushconv_float4 (lua_State *L, Datum dat, luaP_Conv *c) {
+  lua_pushnumber(L, (lua_Number) DatumGetFloat4(dat));
+}
+
+static void luaP_pushconv_float8 (lua_State *L, Datum dat, luaP_Conv *c) {
+  lua_pushnumber(L, (lua_Number) DatumGetFloat8(dat));
+}
+
+static void luaP_pushconv_int2 (lua_State *L, Datum dat, luaP_Conv *c) {
+  lua_pushinteger(L, (lua_Integer) DatumGetInt16(dat));
+}
+
+static void luaP_pushconv_int4 (lua_State *L, Datum dat, luaP_Conv *c) {
+  lua_pushinteger(L, (lua_Integer) DatumGetInt32(dat));
+}
+
+static void luaP_pushconv_int8 (lua_State *L, Datum dat, luaP_Conv *c) {
+  setInt64lua(L, DatumGetInt64(dat));
+}
+
+static void luaP_pushconv_numeric (lua_State *L, Datum dat, luaP_Conv *c) {
+  push_numeric(L, dat);
+}
+
+static void luaP_pushconv_text (lua_State *L, Datum dat, luaP_Conv *c) {
+  luaP_pushvarlena(L, dat);
+}
+
+static void luaP_pushconv_typed (lua_State *L, Datum dat, luaP_Conv *c) {
+  luaP_pushtyped(L, dat, c->type, c->ti);
+}
+
+static void luaP_pushconv_any (lua_State *L, Datum dat, luaP_Conv *c) {
+  luaP_pushdatum(L, dat, c->type);
+}
+
+static Datum luaP_toconv_bool (lua_State *L, luaP_Conv *c, bool *isnull,
+    int idx) {
+  if ((*isnull = lua_isnil(L, idx))) return (Datum) 0;
+  return BoolGetDatum(lua_toboolean(L, idx));
+}
+
+static Datum luaP_toconv_float4 (lua_State *L, luaP_Conv *c, bool *isnull,
+    int idx) {
+  if ((*isnull = lua_isnil(L, idx))) return (Datum) 0;
+  return Float4GetDatum((float4) lua_tonumber(L, idx));
+}
+
+static Datum luaP_toconv_float8 (lua_State *L, luaP_Conv *c, bool *isnull,
+    int idx) {
+  if ((*isnull = lua_isnil(L, idx))) return (Datum) 0;
+  return Float8GetDatum((float8) lua_tonumber(L, idx));
+}
+
+static Datum luaP_toconv_int2 (lua_State *L, luaP_Conv *c, bool *isnull,
+    int idx) {
+  if ((*isnull = lua_isnil(L, idx))) return (Datum) 0;
+  return Int16GetDatum(lua_tointeger(L, idx));
+}
+
+static Datum luaP_toconv_int4 (lua_State *L, luaP_Conv *c, bool *isnull,
+    int idx) {
+  if ((*isnull = lua_isnil(L, idx))) return (Datum) 0;
+  return Int32GetDatum(lua_tointeger(L, idx));
+}
+
+static Datum luaP_toconv_text (lua_State *L, luaP_Conv *c, bool *isnull,
+    int idx) {
+  if ((*isnull = lua_isnil(L, idx))) return (Datum) 0;
+  return luaP_tovarlena(L, c->type, -1, idx);
+}
+
+static Datum luaP_toconv_numeric (lua_State *L, luaP_Conv *c, bool *isnull,
+    int idx) {
+  if ((*isnull = lua_isnil(L, idx))) return (Datum) 0;
+  return get_numeric(L, idx, -1);
+}
+
+static Datum luaP_toconv_typed (lua_State *L, luaP_Conv *c, bool *isnull,
+    int idx) {
+  if ((*isnull = lua_isnil(L, idx))) return (Datum) 0;
+  return luaP_totyped(L, c->type, 0, c->ti, idx);
+}
+
+static Datum luaP_toconv_any (lua_State *L, luaP_Conv *c, bool *isnull,
+    int idx) {
+  return luaP_todatum(L, c->type, 0, isnull, idx);
+}
+
+static void luaP_initconv (luaP_Conv *c, Oid type, luaP_Typeinfo *ti) {
+  c->type = type;
+  c->ti = ti;
+  c->push = luaP_pushconv_any;
+  c->to = luaP_toconv_any;
+  switch (type) {
+    case BOOLOID:
+      c->push = luaP_pushconv_bool;
+      c->to = luaP_toconv_bool;
+      break;
+    case FLOAT4OID:
+      c->push = luaP_pushconv_float4;
+      c->to = luaP_toconv_float4;
+      break;
+    case FLOAT8OID:
+      c->push = luaP_pushconv_float8;
+      c->to = luaP_toconv_float8;
+      break;
+    case INT2OID:
+      c->push = luaP_pushconv_int2;
+      c->to = luaP_toconv_int2;
+      break;
+    case INT4OID:
+      c->push = luaP_pushconv_int4;
+      c->to = luaP_toconv_int4;
+      break;
+    case INT8OID:
+      c->push = luaP_pushconv_int8;
+      break;
+    case NUMERICOID:
+      c->push = luaP_pushconv_numeric;
+      c->to = luaP_toconv_numeric;
+      break;
+    case TEXTOID:
+    case BPCHAROID:
+    case VARCHAROID:
+    case BYTEAOID:
+      c->push = luaP_pushconv_text;
+      c->to = luaP_toconv_text;
+      break;
+    case REFCURSOROID:
+    case RECORDOID:
+      break;
+    default: /* non-builtin: skip switch and typeinfo lookup */
+      if (ti != NULL && ti->type != TYPTYPE_PSEUDO) {
+        c->push = luaP_pushconv_typed;
+        c->to = luaP_toconv_typed;
+      }
+  }
+}
+
+
 /* ======= luaP_callhandler ======= */
 
 static void luaP_cleanthread (lua_State *L, lua_State **thread, luaP_Info *fi) {
@@ -1256,6 +2493,94 @@ static void luaP_cleanthread (lua_State *L, lua_State **thread, luaP_Info *fi) {
     *thread = NULL;
 }
 
+/* releases thread of value-per-call SETOF function stopped before it was
+ * done, e.g. by LIMIT */
+static void luaP_srfshutdown (Datum arg) {
+  luaP_Info *fi = (luaP_Info *) DatumGetPointer(arg);
+  if (fi->L != NULL)
+    luaP_cleanthread(pllua_getmaster(fi->L), &fi->L, fi);
+}
+
+/* runs SETOF function in a new thread until it is done, storing every
+ * yielded value in a tuplestore; function is at the top of the stack.
+ * The whole set is computed even if the caller needs only a few rows */
+static void luaP_materialize (lua_State *L, FunctionCallInfo fcinfo,
+    luaP_Info *fi, ReturnSetInfo *rsi) {
+  int status, nargs = fcinfo->nargs;
+  bool iscomposite, isnull;
+  bool *nulls = NULL;
+  Datum dat;
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore;
+  MemoryContext m;
+  /* result descriptor and tuplestore must outlive this call */
+  m = MemoryContextSwitchTo(rsi->econtext->ecxt_per_query_memory);
+  iscomposite = (get_call_result_type(fcinfo, NULL, &tupdesc)
+      == TYPEFUNC_COMPOSITE);
+  if (!iscomposite) {
+    tupdesc = CreateTemplateTupleDesc(1, false);
+    TupleDescInitEntry(tupdesc, (AttrNumber) 1, "", fi->result, -1, 0);
+  }
+  tupstore = tuplestore_begin_heap(
+      (rsi->allowedModes & SFRM_Materialize_Random) != 0, false, work_mem);
+  MemoryContextSwitchTo(m);
+  /* set up thread */
+  fi->L = lua_newthread(L);
+  lua_pushlightuserdata(L, (void *) fi->L);
+  lua_pushvalue(L, -2); /* thread */
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  lua_pop(L, 1); /* new thread */
+  lua_xmove(L, fi->L, 1); /* function */
+  luaP_pushargs(fi->L, fcinfo, fi);
+  for (;;) {
+    luaP_setlimited(L, true);
+#if LUA_VERSION_NUM <= 501
+    status = lua_resume(fi->L, nargs);
+#else
+    status = lua_resume(fi->L, fi->L, nargs);
+#endif
+    luaP_setlimited(L, false);
+    if (status != LUA_YIELD || lua_isnone(fi->L, 1)) break; /* done? */
+    dat = fi->rconv.to(fi->L, &fi->rconv, &isnull, -1);
+    lua_settop(fi->L, 0);
+    if (!iscomposite)
+      tuplestore_putvalues(tupstore, tupdesc, &dat, &isnull);
+    else if (!isnull) {
+      HeapTupleData tuple;
+      tuple.t_data = DatumGetHeapTupleHeader(dat);
+      tuple.t_len = HeapTupleHeaderGetDatumLength(tuple.t_data);
+      ItemPointerSetInvalid(&(tuple.t_self));
+      tuple.t_tableOid = InvalidOid;
+      tuplestore_puttuple(tupstore, &tuple);
+    }
+    else { /* null record */
+      if (nulls == NULL) {
+        nulls = (bool *) palloc(tupdesc->natts * sizeof(bool));
+        memset(nulls, true, tupdesc->natts * sizeof(bool));
+      }
+      tuplestore_putvalues(tupstore, tupdesc, NULL, nulls);
+    }
+    /* tuplestore keeps its own copy */
+    if (!isnull && (iscomposite || !TupleDescAttr(tupdesc, 0)->attbyval))
+      pfree(DatumGetPointer(dat));
+    nargs = 0; /* resume */
+  }
+  rtds_notinuse(fi->funcxt_wp);
+  if (status != 0 && status != LUA_YIELD) {
+#if defined(PLLUA_DEBUG)
+    luapg_error(fi->L, getLINE());
+#else
+    luapg_error(fi->L, "runtime");
+#endif
+  }
+  luaP_cleanthread(L, &fi->L, fi);
+  if (nulls != NULL) pfree(nulls);
+  rsi->returnMode = SFRM_Materialize;
+  rsi->setResult = tupstore;
+  rsi->setDesc = tupdesc;
+  fcinfo->isnull = true;
+}
+
 Datum luaP_validator (lua_State *L, Oid oid) {
   if (SPI_connect() != SPI_OK_CONNECT)
     elog(ERROR, "[pllua]: could not connect to SPI manager");
@@ -1278,12 +2603,17 @@ Datum luaP_validator (lua_State *L, Oid oid) {
   return 0; /* VOID */
 }
 
+bool luaP_hasqueryenv = false;
+
 Datum luaP_callhandler (lua_State *L, FunctionCallInfo fcinfo) {
   Datum retval = 0;
   int base = 0;
   luaP_Info *fi;
   RTupDescStack prev;
   bool istrigger;
+  bool prevqueryenv = luaP_hasqueryenv;
+  bool prevlimited = luaP_setlimited(L, false);
+  int rowrefs[2] = {LUA_NOREF, LUA_NOREF};
   if (SPI_connect() != SPI_OK_CONNECT)
     elog(ERROR, "[pllua]: could not connect to SPI manager");
   istrigger = CALLED_AS_TRIGGER(fcinfo);
@@ -1298,6 +2628,7 @@ Datum luaP_callhandler (lua_State *L, FunctionCallInfo fcinfo) {
   rtds_inuse(fi->funcxt_wp);
 
   prev = rtds_set_current(fi->funcxt_wp);
+  luaP_hasqueryenv = false; /* nested calls have their own SPI connection */
   PG_TRY();
   {
     if ((fi->result == TRIGGEROID && !istrigger)
@@ -1307,13 +2638,22 @@ Datum luaP_callhandler (lua_State *L, FunctionCallInfo fcinfo) {
                errmsg("[pllua]: trigger function can only be called as trigger")));
     if (istrigger) {
       TriggerData *trigdata = (TriggerData *) fcinfo->context;
-      int i, nargs;
-      luaP_preptrigger(L, trigdata); /* set global trigger table */
+      int i, nargs, status;
+#if PG_VERSION_NUM >= 100000
+      if (SPI_register_trigger_data(trigdata) != SPI_OK_TD_REGISTER)
+        elog(ERROR, "[pllua]: could not register transition tables");
+      luaP_hasqueryenv = (trigdata->tg_newtable != NULL
+          || trigdata->tg_oldtable != NULL);
+#endif
+      luaP_preptrigger(L, trigdata, rowrefs); /* set global trigger table */
       nargs = trigdata->tg_trigger->tgnargs;
       for (i = 0; i < nargs; i++) /* push args */
         lua_pushstring(L, trigdata->tg_trigger->tgargs[i]);
       //trigger call
-      if (lua_pcall(L, nargs, 0, 0)) {
+      luaP_setlimited(L, true);
+      status = lua_pcall(L, nargs, 0, 0);
+      luaP_setlimited(L, false);
+      if (status) {
 #if defined(PLLUA_DEBUG)
         luapg_error(L, getLINE());
 #else
@@ -1323,52 +2663,65 @@ Datum luaP_callhandler (lua_State *L, FunctionCallInfo fcinfo) {
       if (TRIGGER_FIRED_FOR_ROW(trigdata->tg_event)
           && TRIGGER_FIRED_BEFORE(trigdata->tg_event)) /* return? */
         retval = luaP_gettriggerresult(L);
+      luaP_releaserows(L, rowrefs);
       luaP_cleantrigger(L);
     }
     else { /* called as function */
       if (fi->result_isset) { /* SETOF? */
         int status, hasresult;
         ReturnSetInfo *rsi = (ReturnSetInfo *) fcinfo->resultinfo;
-        if (fi->L == NULL) { /* first call? */
-          if (!rsi || !IsA(rsi, ReturnSetInfo)
-              || (rsi->allowedModes & SFRM_ValuePerCall) == 0)
-            ereport(ERROR,
-                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                     errmsg("[pllua]: set-valued function called in context"
-                            "that cannot accept a set")));
-          rsi->returnMode = SFRM_ValuePerCall;
-          fi->L = lua_newthread(L);
-          lua_pushlightuserdata(L, (void *) fi->L);
-          lua_pushvalue(L, -2); /* thread */
-          lua_rawset(L, LUA_REGISTRYINDEX);
-          lua_pop(L, 1); /* new thread */
+        if (fi->L == NULL && rsi && IsA(rsi, ReturnSetInfo)
+            && (rsi->allowedModes & SFRM_Materialize)) { /* whole set? */
+          luaP_materialize(L, fcinfo, fi, rsi);
         }
-        lua_xmove(L, fi->L, 1); /* function */
-        luaP_pushargs(fi->L, fcinfo, fi);
+        else {
+          if (fi->L == NULL) { /* first call? */
+            if (!rsi || !IsA(rsi, ReturnSetInfo)
+                || (rsi->allowedModes & SFRM_ValuePerCall) == 0)
+              ereport(ERROR,
+                      (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                       errmsg("[pllua]: set-valued function called in context"
+                              "that cannot accept a set")));
+            rsi->returnMode = SFRM_ValuePerCall;
+            fi->L = lua_newthread(L);
+            lua_pushlightuserdata(L, (void *) fi->L);
+            lua_pushvalue(L, -2); /* thread */
+            lua_rawset(L, LUA_REGISTRYINDEX);
+            lua_pop(L, 1); /* new thread */
+            RegisterExprContextCallback(rsi->econtext, luaP_srfshutdown,
+                PointerGetDatum(fi));
+          }
+          lua_xmove(L, fi->L, 1); /* function */
+          luaP_pushargs(fi->L, fcinfo, fi);
 
+          luaP_setlimited(L, true);
 #if LUA_VERSION_NUM <= 501
-        status = lua_resume(fi->L, fcinfo->nargs);
+          status = lua_resume(fi->L, fcinfo->nargs);
 #else
-        status = lua_resume(fi->L, fi->L, fcinfo->nargs);
+          status = lua_resume(fi->L, fi->L, fcinfo->nargs);
 #endif
-        rtds_notinuse(fi->funcxt_wp);
-        hasresult = !lua_isnone(fi->L, 1);
-        if (status == LUA_YIELD && hasresult) {
-          rsi->isDone = ExprMultipleResult; /* SRF: next */
-          retval = luaP_getresult(fi->L, fcinfo, fi->result);
-        }
-        else if (status == 0 || !hasresult) { /* last call? */
-          rsi->isDone = ExprEndResult; /* SRF: done */
-          fcinfo->isnull = true;
-          retval = (Datum) 0;
-          luaP_cleanthread(L, &fi->L, fi);
-        }
-        else {
+          luaP_setlimited(L, false);
+          rtds_notinuse(fi->funcxt_wp);
+          hasresult = !lua_isnone(fi->L, 1);
+          if (status == LUA_YIELD && hasresult) {
+            rsi->isDone = ExprMultipleResult; /* SRF: next */
+            retval = luaP_getresult(fi->L, fcinfo, &fi->rconv);
+          }
+          else if (status == 0 || !hasresult) { /* last call? */
+            rsi->isDone = ExprEndResult; /* SRF: done */
+            fcinfo->isnull = true;
+            retval = (Datum) 0;
+            luaP_cleanthread(L, &fi->L, fi);
+            UnregisterExprContextCallback(rsi->econtext, luaP_srfshutdown,
+                PointerGetDatum(fi));
+          }
+          else {
 #if defined(PLLUA_DEBUG)
-          luapg_error(fi->L, getLINE());
+            luapg_error(fi->L, getLINE());
 #else
-          luapg_error(fi->L, "runtime");
+            luapg_error(fi->L, "runtime");
 #endif
+          }
         }
       }
       else {
@@ -1379,7 +2732,9 @@ Datum luaP_callhandler (lua_State *L, FunctionCallInfo fcinfo) {
         lua_pushcfunction(L, traceback);  /* push traceback function */
         lua_insert(L, base);  /* put it under chunk and args */
         //func call
+        luaP_setlimited(L, true);
         status = lua_pcall(L, fcinfo->nargs, 1, base);
+        luaP_setlimited(L, false);
         lua_remove(L, base);  /* remove traceback function */
         if (status){
 
@@ -1392,7 +2747,7 @@ Datum luaP_callhandler (lua_State *L, FunctionCallInfo fcinfo) {
         }
         fi->funcxt_wp = rtds_unref(fi->funcxt_wp);
 
-        retval = luaP_getresult(L, fcinfo, fi->result);
+        retval = luaP_getresult(L, fcinfo, &fi->rconv);
       }
     }
     /* stack should be clean here: lua_gettop(L) == 0 */
@@ -1400,6 +2755,7 @@ Datum luaP_callhandler (lua_State *L, FunctionCallInfo fcinfo) {
   PG_CATCH();
   {
     if (L != NULL) {
+      luaP_releaserows(L, rowrefs);
       luaP_cleantrigger(L);//fi->funcxt ref--
 
       if (fi->result_isset && fi->L != NULL) /* clean thread? */
@@ -1408,9 +2764,13 @@ Datum luaP_callhandler (lua_State *L, FunctionCallInfo fcinfo) {
     }
     fcinfo->isnull = true;
     retval = (Datum) 0;
+    luaP_hasqueryenv = prevqueryenv;
+    luaP_setlimited(L, prevlimited);
     PG_RE_THROW();
   }
   PG_END_TRY();
+  luaP_hasqueryenv = prevqueryenv;
+  luaP_setlimited(L, prevlimited);
   rtds_set_current(prev);
   if (SPI_finish() != SPI_OK_FINISH)
     elog(ERROR, "[pllua]: could not disconnect from SPI manager");
@@ -1429,6 +2789,7 @@ Datum luaP_inlinehandler (lua_State *L, const char *source) {
   RTupDescStack prev;
   int base = 0;
   int status = 0;
+  bool prevlimited = luaP_setlimited(L, false);
   if (SPI_connect() != SPI_OK_CONNECT)
     elog(ERROR, "[pllua]: could not connect to SPI manager");
 
@@ -1451,13 +2812,16 @@ Datum luaP_inlinehandler (lua_State *L, const char *source) {
     base = lua_gettop(L) ;  /* function index */
     lua_pushcfunction(L, traceback);  /* push traceback function */
     lua_insert(L, base);  /* put it under chunk and args */
+    luaP_setlimited(L, true);
     status = lua_pcall(L, 0, 0, base);
+    luaP_setlimited(L, false);
     lua_remove(L, base);  /* remove traceback function */
   }
   PG_CATCH();
   {
     funcxt = rtds_unref(funcxt);
     rtds_set_current(prev);
+    luaP_setlimited(L, prevlimited);
 
     if (L != NULL) {
       lua_settop(L, 0); /* clear Lua stack */
@@ -1469,6 +2833,7 @@ Datum luaP_inlinehandler (lua_State *L, const char *source) {
 
   funcxt = rtds_unref(funcxt);
   rtds_set_current(prev);
+  luaP_setlimited(L, prevlimited);
 
   if (status) {
     lua_gc(L, LUA_GCCOLLECT, 0);
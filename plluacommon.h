@@ -5,7 +5,9 @@
 #include <postgres.h>
 #include <fmgr.h>
 #include <funcapi.h>
+#include <miscadmin.h>
 #include <access/heapam.h>
+#include <access/tuptoaster.h>
 #include <access/xact.h>
 #if PG_VERSION_NUM >= 90300
 #include <access/htup_details.h>
@@ -14,22 +16,31 @@
 #include <catalog/pg_proc.h>
 #include <catalog/pg_type.h>
 #include <commands/trigger.h>
+#include <executor/executor.h>
 #include <executor/spi.h>
 #include <nodes/makefuncs.h>
 #include <parser/parse_type.h>
 #include <utils/array.h>
 #include <utils/builtins.h>
 #include <utils/datum.h>
+#include <utils/guc.h>
+#include <utils/inval.h>
 #include <utils/lsyscache.h>
 #include <utils/memutils.h>
 #include <utils/rel.h>
 #include <utils/syscache.h>
+#include <utils/tuplestore.h>
 #include <utils/typcache.h>
 /* Lua */
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 
+/* LuaJIT's lualib.h names its jit library */
+#ifdef LUA_JITLIBNAME
+#define PLLUA_LUAJIT
+#endif
+
 #if LUA_VERSION_NUM <= 501
 #define lua_pushglobaltable(L) lua_pushvalue(L, LUA_GLOBALSINDEX)
 #define lua_setuservalue lua_setfenv
@@ -61,16 +72,6 @@ void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup);
 #endif
 
 
-#define lua_push_oidstring(L, oid) do\
-{\
-    luaL_Buffer b;\
-    luaL_buffinit(L, &b);\
-    lua_pushinteger(L, oid);\
-    luaL_addstring(&b, "oid_");\
-    luaL_addvalue(&b);\
-    luaL_pushresult(&b);\
-}while(0)
-
 typedef struct {
     const char* name;
     bool hasTraceback;
@@ -85,13 +86,18 @@ int pllua_getmaster_index(lua_State *L);
 #if PG_VERSION_NUM < 110000
     #define TupleDescAttr(tupdesc, i) ((tupdesc)->attrs[(i)])
 
-    #define pg_create_context(name) \
-            AllocSetContextCreate(TopMemoryContext, \
+    #define pg_create_subcontext(parent, name) \
+            AllocSetContextCreate(parent, \
                 name, ALLOCSET_DEFAULT_MINSIZE, ALLOCSET_DEFAULT_INITSIZE, \
                 ALLOCSET_DEFAULT_MAXSIZE);
 #else
-    #define pg_create_context(name) \
-            AllocSetContextCreate(TopMemoryContext, name, ALLOCSET_DEFAULT_SIZES);
+    #define pg_create_subcontext(parent, name) \
+            AllocSetContextCreate(parent, name, ALLOCSET_DEFAULT_SIZES);
+#endif
+#define pg_create_context(name) pg_create_subcontext(TopMemoryContext, name)
+
+#ifndef VARATT_IS_EXTERNAL_ONDISK /* before 9.4 */
+#define VARATT_IS_EXTERNAL_ONDISK(PTR) VARATT_IS_EXTERNAL(PTR)
 #endif
 
 #define lua_swap(L) lua_insert(L, -2)
@@ -100,6 +106,19 @@ int pllua_getmaster_index(lua_State *L);
     lua_pushlightuserdata((L), (void *)(s)); \
     lua_rawget((L), LUA_REGISTRYINDEX)
 
+/* integer-keyed registry caches: REG[key][oid] */
+#define luaP_getoidcache(L, key, oid) \
+    luaP_getfield(L, key); \
+    lua_rawgeti((L), -1, (int) (oid)); \
+    lua_remove((L), -2)
+
+/* stores and pops value at top of stack */
+#define luaP_setoidcache(L, key, oid) \
+    luaP_getfield(L, key); \
+    lua_insert((L), -2); \
+    lua_rawseti((L), -2, (int) (oid)); \
+    lua_pop((L), 1)
+
 #define MTOLUA(state) {MemoryContext ___mcxt,___m;\
     ___mcxt = luaP_getmemctxt(state); \
     ___m  = MemoryContextSwitchTo(___mcxt)
@@ -22,6 +22,8 @@ static const char PLLUA_P_TUPLEMT[] = "ptuple";
 static const char PLLUA_PLANMT[] = "plan";
 static const char PLLUA_CURSORMT[] = "cursor";
 static const char PLLUA_TUPTABLEMT[] = "tupletable";
+static const char PLLUA_TRANSITIONMT[] = "transition";
+static const char PLLUA_PLANCACHE[] = "plancache";
 
 #include "rtupdesc.h"
 
@@ -32,9 +34,17 @@ typedef struct luaP_Tuple {
   TupleDesc tupdesc;
   Datum *value;
   bool *null;
+  bool *replace; /* columns set from Lua, valid if changed == 1 */
   RTupDesc *rtupdesc;
+  int ndeformed; /* value/null are valid up to this attribute */
+  long off; /* offset of next attribute in tuple data */
+  bool slow; /* can't use attcacheoff anymore */
 } luaP_Tuple;
 
+/* tuple header and value arrays; a copied tuple follows them */
+#define luaP_tuplesize(n) \
+  MAXALIGN(sizeof(luaP_Tuple) + (n) * (sizeof(Datum) + 2 * sizeof(bool)))
+
 typedef struct luaP_Tuptable {
   int size;
   Portal cursor;
@@ -48,15 +58,38 @@ typedef struct luaP_Cursor {
   RTupDesc *rtupdesc;
   void *tupleQueue;
   void *resptr;
+  int fetchsize; /* rows per fetch in rows iterator */
+  bool adaptive; /* grow fetchsize on long scans? */
 } luaP_Cursor;
 
 typedef struct luaP_Plan {
   int nargs;
   int issaved;
   SPI_plan *plan;
+  Datum *values; /* argument buffers, follow type */
+  char *nulls;
   Oid type[1];
 } luaP_Plan;
 
+/* saved plan of ad-hoc query, in LRU list of plan cache */
+typedef struct luaP_CachedPlan {
+  SPI_plan *plan;
+  char *query;
+  int inuse; /* executions in progress; not evicted while set */
+  struct luaP_CachedPlan *prev, *next;
+} luaP_CachedPlan;
+
+/* query -> entry lookup table is the uservalue */
+typedef struct luaP_PlanCache {
+  luaP_CachedPlan *head, *tail; /* most and least recently used */
+  int count;
+  long hits, misses;
+} luaP_PlanCache;
+
+#define luaP_plansize(n) \
+  (MAXALIGN(sizeof(luaP_Plan) + (n) * sizeof(Oid)) \
+   + (n) * (sizeof(Datum) + sizeof(char)))
+
 
 /* ======= Utils ======= */
 
@@ -107,41 +140,107 @@ void luaP_pushdesctable (lua_State *L, TupleDesc desc) {
   }
 }
 
+/* copies tuple to dest, which has room for HEAPTUPLESIZE + t_len bytes */
+static HeapTuple luaP_copytupleto (HeapTuple tuple, void *dest) {
+  HeapTuple copy = (HeapTuple) dest;
+  copy->t_len = tuple->t_len;
+  copy->t_self = tuple->t_self;
+  copy->t_tableOid = tuple->t_tableOid;
+  copy->t_data = (HeapTupleHeader) ((char *) copy + HEAPTUPLESIZE);
+  memcpy(copy->t_data, tuple->t_data, tuple->t_len);
+  return copy;
+}
+
+/* fills t->value and t->null up to attribute natts, resuming where the last
+ * call stopped; adapted from slot_deform_tuple */
+static void luaP_deform (luaP_Tuple *t, TupleDesc tupdesc, int natts) {
+  HeapTupleHeader tup;
+  bool hasnulls;
+  bits8 *bp;
+  char *tp;
+  int maxatt;
+  int attnum = t->ndeformed;
+  long off = t->off;
+  bool slow = t->slow;
+  if (natts > tupdesc->natts) natts = tupdesc->natts;
+  if (attnum >= natts || t->tuple == NULL) return; /* done or released */
+  tup = t->tuple->t_data;
+  hasnulls = HeapTupleHasNulls(t->tuple);
+  bp = tup->t_bits;
+  tp = (char *) tup + tup->t_hoff;
+  maxatt = HeapTupleHeaderGetNatts(tup);
+  for (; attnum < natts && attnum < maxatt; attnum++) {
+    Form_pg_attribute thisatt = TupleDescAttr(tupdesc, attnum);
+    if (hasnulls && att_isnull(attnum, bp)) {
+      t->value[attnum] = (Datum) 0;
+      t->null[attnum] = true;
+      slow = true; /* can't use attcacheoff anymore */
+      continue;
+    }
+    t->null[attnum] = false;
+    if (!slow && thisatt->attcacheoff >= 0)
+      off = thisatt->attcacheoff;
+    else if (thisatt->attlen == -1) { /* varlena: check for pad byte */
+      if (!slow && off == att_align_nominal(off, thisatt->attalign))
+        thisatt->attcacheoff = off;
+      else {
+        off = att_align_pointer(off, thisatt->attalign, -1, tp + off);
+        slow = true;
+      }
+    }
+    else {
+      off = att_align_nominal(off, thisatt->attalign);
+      if (!slow) thisatt->attcacheoff = off;
+    }
+    t->value[attnum] = fetchatt(thisatt, tp + off);
+    off = att_addlength_pointer(off, thisatt->attlen, tp + off);
+    if (thisatt->attlen <= 0) slow = true; /* can't use attcacheoff anymore */
+  }
+  for (; attnum < natts; attnum++) /* added after tuple was formed? */
+    t->value[attnum] = heap_getattr(t->tuple, attnum + 1, tupdesc,
+        t->null + attnum);
+  if (attnum > t->ndeformed) {
+    t->ndeformed = attnum;
+    t->off = off;
+    t->slow = slow;
+  }
+}
+
+#define luaP_deformto(t, desc, i) \
+  do { if ((i) >= (t)->ndeformed) luaP_deform((t), (desc), (i) + 1); } while (0)
+
+static void luaP_inittuple (luaP_Tuple *t, HeapTuple tuple, int n,
+    int readonly) {
+  t->value = (Datum *) (t + 1);
+  t->null = (bool *) (t->value + n);
+  t->replace = t->null + n;
+  t->changed = (readonly) ? -1 : 0;
+  t->tupdesc = 0;
+  t->relid = 0;
+  t->tuple = tuple;
+  t->ndeformed = 0;
+  t->off = 0;
+  t->slow = false;
+}
+
+/* tuple is copied into userdata, as it can outlive its tuple table, and
+ * deformed on demand */
 static void luaP_pushtuple_cmn (lua_State *L, HeapTuple tuple,
                       int readonly, RTupDesc* rtupdesc) {
     luaP_Tuple *t;
     TupleDesc tupleDesc;
-    int i, n;
+    int n;
+    size_t size;
 
     BEGINLUA;
     tupleDesc = rtupdesc->tupdesc;
     n = tupleDesc->natts;
+    size = luaP_tuplesize(n);
 
-    t = lua_newuserdata(L, sizeof(luaP_Tuple)
-                        + n * (sizeof(Datum) + sizeof(bool)));
-
-    t->value = (Datum *) (t + 1);
-    t->null = (bool *) (t->value + n);
+    t = lua_newuserdata(L, size + HEAPTUPLESIZE + tuple->t_len);
+    tuple = luaP_copytupleto(tuple, (char *) t + size);
+    luaP_inittuple(t, tuple, n, readonly);
     t->rtupdesc = rtupdesc_ref(rtupdesc);
-    for (i = 0; i < n; i++) {
-
-        bool isnull;
-        t->value[i] = heap_getattr(tuple, TupleDescAttr(tupleDesc, i)->attnum, tupleDesc,
-                                   &isnull);
-        t->null[i] = isnull;
-    }
-
-    if (readonly) {
-        t->changed = -1;
-    }
-    else {
-        t->changed = 0;
-    }
-
-    t->tupdesc = 0;
-
-    t->relid = 0;
-    t->tuple = tuple;
     luaP_getfield(L, PLLUA_TUPLEMT);
     lua_setmetatable(L, -2);
     ENDLUAV(1);
@@ -181,71 +280,83 @@ luaP_pushrecord(lua_State *L, Datum record){
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-#define FETCH_CSR_Q 50
-#define TUPLE_QUEUE_SIZE FETCH_CSR_Q + 1
+#define FETCH_CSR_MAX 1000 /* limit of adaptive growth */
+#define FETCH_QUEUE_INIT 16 /* initial queue size; grows to batch size */
+#define FETCH_BATCH_MAX ((int) (MaxAllocSize / sizeof(luaP_Tuple *)))
 typedef struct {
-int head, tail;
-luaP_Tuple* data[TUPLE_QUEUE_SIZE];
+int head, count, size;
+luaP_Tuple** data;
 } TupleQueue, *TupleQueuePtr;
 
-static TupleQueuePtr tq_initQueue(lua_State *L) {
+static TupleQueuePtr tq_initQueue(lua_State *L, int size) {
     TupleQueuePtr qp;
     MTOLUA(L);
     qp = (TupleQueuePtr) palloc(sizeof(TupleQueue));
+    qp -> data = (luaP_Tuple **) palloc(size * sizeof(luaP_Tuple *));
     MTOPG;
-    qp -> head = qp -> tail = 0;
+    qp -> head = qp -> count = 0;
+    qp -> size = size;
     return qp;
 }
+static void tq_freeQueue(TupleQueuePtr Q) {
+    pfree(Q -> data);
+    pfree(Q);
+}
 static int tq_isempty(TupleQueuePtr Q) {
-    return (Q -> head == Q -> tail);
+    return (Q -> count == 0);
+}
+/* empty queue is refilled from start; storage grows to hold size tuples */
+static void tq_reserve(TupleQueuePtr Q, int size) {
+    Q -> head = 0;
+    if (size > Q -> size) {
+        Q -> data = (luaP_Tuple **) repalloc(Q -> data,
+                                             size * sizeof(luaP_Tuple *));
+        Q -> size = size;
+    }
 }
 
 static void tq_enqueue(TupleQueuePtr Q, luaP_Tuple* n) {
-    if (Q -> tail == TUPLE_QUEUE_SIZE - 1)
-        Q -> tail = 0;
-    else
-        ++(Q -> tail);
-    if (Q -> tail == Q -> head) { //Queue is full
-        return;
-    }
-    Q -> data[Q -> tail] = n;
+    Q -> data[Q -> head + Q -> count] = n;
+    ++(Q -> count);
 }
 
 static luaP_Tuple* tq_dequeue(TupleQueuePtr Q) {
     if (tq_isempty(Q)) {
         return NULL;
     }
-    if (Q -> head == TUPLE_QUEUE_SIZE - 1)
-        Q -> head = 0;
-    else
-        ++(Q -> head);
-    return Q -> data[Q -> head];
+    --(Q -> count);
+    return Q -> data[(Q -> head)++];
 }
-#undef TUPLE_QUEUE_SIZE
 
 static int luaP_rowsaux (lua_State *L) {
     luaP_Cursor *c;
     luaP_Tuple* t;
-    unsigned int i;
-    uint32		processed = 0;
+    TupleQueuePtr q;
+    int i, processed;
 
     BEGINLUA;
     c = (luaP_Cursor *) lua_touserdata(L, lua_upvalueindex(1));
 
-    if (c->tupleQueue && tq_isempty(c->tupleQueue)){
-        pfree(c->tupleQueue);
-        c->tupleQueue = NULL;
+    if (c->cursor == NULL){ /* done? */
+        lua_pushnil(L);
+        ENDLUAV(1);
+        return 1;
     }
+    if (c->tupleQueue == NULL)
+        c->tupleQueue = tq_initQueue(L, Min(c->fetchsize, FETCH_QUEUE_INIT));
+    q = (TupleQueuePtr) c->tupleQueue;
 
-    if (c->tupleQueue == NULL){
-
+    if (tq_isempty(q)){
 
     PLLUA_PG_CATCH_RETHROW(
-      SPI_cursor_fetch(c->cursor, 1, FETCH_CSR_Q);
+      SPI_cursor_fetch(c->cursor, 1, c->fetchsize);
 		);
 
-        if (SPI_processed == 0){
+        processed = (int) SPI_processed;
+        if (processed == 0){
             SPI_freetuptable(SPI_tuptable);
+            tq_freeQueue(q);
+            c->tupleQueue = NULL;
             c->rtupdesc = rtupdesc_unref(c->rtupdesc);
             c->resptr = unregister_resource(c->resptr);
             SPI_cursor_close(c->cursor);
@@ -257,26 +368,30 @@ static int luaP_rowsaux (lua_State *L) {
         if(c->rtupdesc == NULL){
             c->rtupdesc = rtupdesc_ctor(L,SPI_tuptable->tupdesc);
         }
-        c->tupleQueue = tq_initQueue(L);
-        for (i = 0; i < SPI_processed; i++)
+        MTOLUA(L);
+        tq_reserve(q, processed);
+        MTOPG;
+        for (i = 0; i < processed; i++)
         {
             HeapTuple	tuple = SPI_tuptable->vals[i];
             t = luaP_PTuple_rawctr(L, tuple, 1, c->rtupdesc);
-            tq_enqueue(c->tupleQueue, t);
-            processed++;
+            tq_enqueue(q, t);
         }
         SPI_freetuptable(SPI_tuptable);
-
+        /* long scan: fetch more at a time */
+        if (c->adaptive && processed == c->fetchsize
+            && c->fetchsize < FETCH_CSR_MAX)
+            c->fetchsize = Min(c->fetchsize * 2, FETCH_CSR_MAX);
     }
 
-    t = tq_dequeue(c->tupleQueue);
+    t = tq_dequeue(q);
 
     LUAP_pushtuple_from_ptr(L, t);
 
     ENDLUAV(1);
     return 1;
 }
-#undef FETCH_CSR_Q
+#undef FETCH_CSR_MAX
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -306,21 +421,6 @@ luaP_Buffer *luaP_getbuffer (lua_State *L, int n) {
   return b;
 }
 
-static void luaP_fillbuffer (lua_State *L, int pos, Oid *type,
-    luaP_Buffer *b) {
-  lua_pushnil(L);
-  while (lua_next(L, pos)) {
-    int k = lua_tointeger(L, -2);
-    if (k > 0) {
-      bool isnull;
-      k--; /* zero based */
-      b->value[k] = luaP_todatum(L, type[k], 0, &isnull, -1);
-      b->null[k] = (isnull) ? 'n' : ' ';
-    }
-    lua_pop(L, 1);
-  }
-}
-
 static void cursor_cleanup_p(void *d, int gccall){
     luaP_Cursor *c = (luaP_Cursor *)d;
     if (c->tupleQueue){
@@ -329,6 +429,7 @@ static void cursor_cleanup_p(void *d, int gccall){
             pfree(t);
             t = tq_dequeue(c->tupleQueue);
         }
+        tq_freeQueue(c->tupleQueue);
         c->tupleQueue  = NULL;
 
         c->rtupdesc = rtupdesc_unref(c->rtupdesc);
@@ -361,37 +462,20 @@ static int luaP_tuplegc (lua_State *L) {
     rtupdesc_unref(t->rtupdesc);
     return 0;
 }
+/* tuple is copied, so that it survives its SPI tuple table */
 static luaP_Tuple* luaP_PTuple_rawctr(lua_State * L, HeapTuple tuple, int readonly, RTupDesc* rtupdesc){
     luaP_Tuple *t;
-    TupleDesc tupleDesc;
-    int i, n;
+    int n;
+    size_t size;
 
-    tupleDesc = rtupdesc->tupdesc;
-    n = tupleDesc->natts;
+    n = rtupdesc->tupdesc->natts;
+    size = luaP_tuplesize(n);
     MTOLUA(L);
-    t = palloc(sizeof(luaP_Tuple) + n * (sizeof(Datum) + sizeof(bool)));
+    t = palloc(size + HEAPTUPLESIZE + tuple->t_len);
     MTOPG;
-    t->value = (Datum *) (t + 1);
-    t->null = (bool *) (t->value + n);
+    luaP_inittuple(t, luaP_copytupleto(tuple, (char *) t + size), n,
+        readonly);
     t->rtupdesc = rtupdesc_ref(rtupdesc);
-    for (i = 0; i < n; i++) {
-        bool isnull;
-        t->value[i] = heap_getattr(tuple, TupleDescAttr(tupleDesc, i)->attnum, tupleDesc,
-                                   &isnull);
-        t->null[i] = isnull;
-    }
-
-    if (readonly) {
-        t->changed = -1;
-    }
-    else {
-        t->changed = 0;
-    }
-
-    t->tupdesc = 0;
-
-    t->relid = 0;
-    t->tuple = tuple;
     return t;
 }
 
@@ -420,7 +504,6 @@ static int luaP_p_tuplegc (lua_State *L) {
 static int luaP_p_tupleindex (lua_State *L) {
     const char *name;
     int i =-1;
-    int idx = -1;
     luaP_Tuple *t = *(luaP_Tuple **) lua_touserdata(L, 1);
 
     if (lua_type(L, 2) == LUA_TNUMBER){
@@ -434,6 +517,7 @@ static int luaP_p_tupleindex (lua_State *L) {
                 return 1;
             }
             if ((i >= 0)&&(i < tupleDesc->natts)) {
+                luaP_deformto(t, tupleDesc, i);
                 if (!t->null[i])
                     luaP_pushdatum(L, t->value[i], TupleDescAttr(tupleDesc, i)->atttypid);
                 else lua_pushnil(L);
@@ -458,15 +542,9 @@ static int luaP_p_tupleindex (lua_State *L) {
             lua_pushnil(L);
             return 1;
         }
-        for (i = 0; i< tupleDesc->natts; ++i){
-
-            if (strcmp(NameStr(TupleDescAttr(tupleDesc, i)->attname),name) == 0){
-                idx = i;
-                break;
-            }
-        }
-        i = idx;
+        i = rtupdesc_attindex(t->rtupdesc, name);
         if (i >= 0) {
+            luaP_deformto(t, tupleDesc, i);
             if (!t->null[i])
                 luaP_pushdatum(L, t->value[i], TupleDescAttr(tupleDesc, i)->atttypid);
             else lua_pushnil(L);
@@ -487,7 +565,6 @@ static int luaP_tupleindex (lua_State *L) {
   luaP_Tuple *t = (luaP_Tuple *) lua_touserdata(L, 1);
   const char *name = luaL_checkstring(L, 2);
   int i =-1;
-  int idx = -1;
   if (t->rtupdesc){
       TupleDesc tupleDesc = rtupdesc_gettup(t->rtupdesc);
       if (tupleDesc == NULL){
@@ -495,15 +572,9 @@ static int luaP_tupleindex (lua_State *L) {
           lua_pushnil(L);
           return 1;
       }
-      for (i = 0; i< tupleDesc->natts; ++i){
-
-          if (strcmp(NameStr(TupleDescAttr(tupleDesc, i)->attname),name) == 0){
-              idx = i;
-              break;
-          }
-      }
-      i = idx;
+      i = rtupdesc_attindex(t->rtupdesc, name);
       if (i >= 0) {
+          luaP_deformto(t, tupleDesc, i);
           if (!t->null[i])
             luaP_pushdatum(L, t->value[i], TupleDescAttr(tupleDesc, i)->atttypid);
           else lua_pushnil(L);
@@ -517,13 +588,13 @@ static int luaP_tupleindex (lua_State *L) {
   //triggers data
 
 
-  lua_push_oidstring(L, (int) t->relid);
-  lua_rawget(L, LUA_REGISTRYINDEX);
+  luaP_getreldesc(L, t->relid);
   lua_getfield(L, -1, name);
   i = luaL_optinteger(L, -1, -1);
 
 
   if (i >= 0) {
+      luaP_deformto(t, t->tupdesc, i);
       if (!t->null[i])
         luaP_pushdatum(L, t->value[i], TupleDescAttr(t->tupdesc, i)->atttypid);
       else lua_pushnil(L);
@@ -538,17 +609,22 @@ static int luaP_tuplenewindex (lua_State *L) {
   int i;
   if (t->changed == -1) /* read-only? */
     return luaL_error(L, "tuple is read-only");
-  lua_push_oidstring(L, (int) t->relid);
-  lua_rawget(L, LUA_REGISTRYINDEX);
+  luaP_getreldesc(L, t->relid);
   lua_getfield(L, -1, name);
   i = luaL_optinteger(L, -1, -1);
   lua_settop(L, 3);
   if (i >= 0) { /* found? */
     bool isnull;
+    /* deform past i, so that the new value is not overwritten */
+    luaP_deformto(t, t->tupdesc, i);
+    if (t->changed == 0) { /* first change? */
+      memset(t->replace, 0, t->tupdesc->natts * sizeof(bool));
+      t->changed = 1;
+    }
     t->value[i] = luaP_todatum(L, TupleDescAttr(t->tupdesc, i)->atttypid,
         TupleDescAttr(t->tupdesc, i)->atttypmod, &isnull, -1);
     t->null[i] = isnull;
-    t->changed = 1;
+    t->replace[i] = true;
   }
   else
     return luaL_error(L, "column not found in relation: '%s'", name);
@@ -563,51 +639,60 @@ static int luaP_tupletostring (lua_State *L) {
 void luaP_pushtuple_trg (lua_State *L, TupleDesc desc, HeapTuple tuple,
                      Oid relid, int readonly) {
     luaP_Tuple *t;
-    int i, n;
+    int n;
 
     BEGINLUA;
 
     n = desc->natts;
 
-    t = lua_newuserdata(L, sizeof(luaP_Tuple)
-                        + n * (sizeof(Datum) + sizeof(bool)));
-    if (readonly) {
-        t->changed = -1;
-    }
-    else {
-        t->changed = 0;
-    }
-
-    t->value = (Datum *) (t + 1);
-    t->null = (bool *) (t->value + n);
-
+    t = lua_newuserdata(L, luaP_tuplesize(n));
+    luaP_inittuple(t, tuple, n, readonly);
     t->rtupdesc = 0;
-    for (i = 0; i < n; i++) {
-        bool isnull;
-        t->value[i] = heap_getattr(tuple, TupleDescAttr(desc, i)->attnum, desc,
-                                   &isnull);
-        t->null[i] = isnull;
-    }
-
     t->tupdesc = desc;
     t->relid = relid;
-    t->tuple = tuple;
     luaP_getfield(L, PLLUA_TUPLEMT);
     lua_setmetatable(L, -2);
     ENDLUAV(1);
 }
 
 
-/* adapted from SPI_modifytuple */
+/* deforms trigger row at idx and detaches it from its tuple, which is freed
+ * when the trigger call returns */
+void luaP_releasetuple (lua_State *L, int idx) {
+  luaP_Tuple *t = luaP_toudata(L, idx, PLLUA_TUPLEMT);
+  if (t == NULL || t->tupdesc == NULL || t->tuple == NULL) return;
+  luaP_deform(t, t->tupdesc, t->tupdesc->natts);
+  t->tuple = NULL;
+}
+
+/* replaces changed columns; result is formed once, in upper memory
+ * context, by SPI_modifytuple */
 static HeapTuple luaP_copytuple (luaP_Tuple *t) {
-  HeapTuple tuple = heap_form_tuple(t->tupdesc, t->value, t->null);
-  /* copy identification info */
-  tuple->t_data->t_ctid = t->tuple->t_data->t_ctid;
-  tuple->t_self = t->tuple->t_self;
-  tuple->t_tableOid = t->tuple->t_tableOid;
-  if (t->tupdesc->tdhasoid)
-    HeapTupleSetOid(tuple, HeapTupleGetOid(t->tuple));
-  return SPI_copytuple(tuple); /* in upper mem context */
+  int natts = t->tupdesc->natts;
+  int *attnum = (int *) palloc(natts * sizeof(int));
+  Datum *value = (Datum *) palloc(natts * sizeof(Datum));
+  char *null = (char *) palloc(natts * sizeof(char));
+  int i, n = 0;
+  Relation rel;
+  HeapTuple tuple;
+  for (i = 0; i < natts; i++) {
+    if (t->replace[i]) {
+      attnum[n] = i + 1;
+      value[n] = t->value[i];
+      null[n] = (t->null[i]) ? 'n' : ' ';
+      n++;
+    }
+  }
+  rel = RelationIdGetRelation(t->relid);
+  tuple = SPI_modifytuple(rel, t->tuple, n, attnum, value, null);
+  RelationClose(rel);
+  if (tuple == NULL)
+    elog(ERROR, "[pllua]: could not modify tuple: %s",
+        SPI_result_code_string(SPI_result));
+  pfree(attnum);
+  pfree(value);
+  pfree(null);
+  return tuple;
 }
 
 static luaP_Tuple *luaP_checktuple (lua_State *L, int pos) {
@@ -627,6 +712,8 @@ static luaP_Tuple *luaP_checktuple (lua_State *L, int pos) {
 HeapTuple luaP_totuple (lua_State *L) {
   luaP_Tuple *t = luaP_checktuple(L, -1);
   if (t == NULL) return NULL; /* not a tuple */
+  if (t->tuple == NULL)
+    elog(ERROR, "[pllua]: row of a finished trigger call cannot be returned");
   return (t->changed == 1) ? luaP_copytuple(t) : t->tuple;
 }
 
@@ -636,21 +723,16 @@ HeapTuple luaP_casttuple (lua_State *L, TupleDesc tupdesc) {
   int i;
   luaP_Buffer *b;
   if (t == NULL) return NULL; /* not a tuple */
-  lua_push_oidstring(L, (int) t->relid);
-  lua_rawget(L, LUA_REGISTRYINDEX); /* tuple desc table */
+  luaP_deform(t, t->tupdesc, t->tupdesc->natts);
+  luaP_getreldesc(L, t->relid); /* tuple desc table */
   b = luaP_getbuffer(L, tupdesc->natts);
   for (i = 0; i < tupdesc->natts; i++) {
     int j;
     lua_getfield(L, -1, NameStr(TupleDescAttr(tupdesc, i)->attname));
     j = luaL_optinteger(L, -1, -1);
     if (j >= 0) {
-      if (t->changed == -1) /* read-only? */
-        b->value[i] = heap_getattr(t->tuple,
-            TupleDescAttr(t->tupdesc, j)->attnum, t->tupdesc, b->null + i);
-      else {
-        b->value[i] = t->value[j];
-        b->null[i] = t->null[j];
-      }
+      b->value[i] = t->value[j];
+      b->null[i] = t->null[j];
     }
     lua_pop(L, 1);
   }
@@ -739,6 +821,88 @@ static int luaP_tuptabletostring (lua_State *L) {
 }
 
 
+/* ======= Columns ======= */
+
+/* builds table of column arrays from tuptable at 1 with nrows at 2 */
+static int luaP_fillcolumns (lua_State *L) {
+  SPITupleTable *tuptable = (SPITupleTable *) lua_touserdata(L, 1);
+  int nrows = (int) lua_tointeger(L, 2);
+  TupleDesc tupdesc = tuptable->tupdesc;
+  int natts = tupdesc->natts;
+  int base, i, j;
+  Oid *type;
+  Datum *value;
+  bool *null;
+  luaL_checkstack(L, natts + 2, "too many columns");
+  /* scratch arrays */
+  value = (Datum *) lua_newuserdata(L,
+      natts * (sizeof(Datum) + sizeof(Oid) + sizeof(bool)));
+  type = (Oid *) (value + natts);
+  null = (bool *) (type + natts);
+  lua_createtable(L, 0, natts);
+  base = lua_gettop(L);
+  for (j = 0; j < natts; j++) {
+    Form_pg_attribute att = TupleDescAttr(tupdesc, j);
+    type[j] = (att->attisdropped) ? InvalidOid : att->atttypid;
+    lua_createtable(L, nrows, 0);
+  }
+  for (i = 0; i < nrows; i++) {
+    heap_deform_tuple(tuptable->vals[i], tupdesc, value, null);
+    for (j = 0; j < natts; j++) {
+      if (null[j] || type[j] == InvalidOid) continue; /* nil */
+      switch (type[j]) {
+        case BOOLOID:
+          lua_pushboolean(L, (int) (value[j] != 0));
+          break;
+        case INT2OID:
+          lua_pushinteger(L, (lua_Integer) DatumGetInt16(value[j]));
+          break;
+        case INT4OID:
+          lua_pushinteger(L, (lua_Integer) DatumGetInt32(value[j]));
+          break;
+        case FLOAT4OID:
+          lua_pushnumber(L, (lua_Number) DatumGetFloat4(value[j]));
+          break;
+        case FLOAT8OID:
+          lua_pushnumber(L, (lua_Number) DatumGetFloat8(value[j]));
+          break;
+        default:
+          luaP_pushdatum(L, value[j], type[j]);
+      }
+      lua_rawseti(L, base + 1 + j, i + 1);
+    }
+  }
+  for (j = natts - 1; j >= 0; j--) { /* columns are on top of result */
+    if (type[j] == InvalidOid)
+      lua_pop(L, 1);
+    else
+      lua_setfield(L, base, NameStr(TupleDescAttr(tupdesc, j)->attname));
+  }
+  return 1;
+}
+
+/* pushes SPI_tuptable as a table of column arrays keyed by column name and
+ * the number of rows, or nil if there are no rows; frees SPI_tuptable, also
+ * if a value cannot be converted */
+static int luaP_pushcolumns (lua_State *L) {
+  SPITupleTable *tuptable = SPI_tuptable;
+  int nrows = (int) SPI_processed;
+  int status;
+  if (tuptable == NULL || nrows == 0) { /* no rows? */
+    SPI_freetuptable(tuptable);
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_pushcfunction(L, luaP_fillcolumns);
+  lua_pushlightuserdata(L, (void *) tuptable);
+  lua_pushinteger(L, nrows);
+  status = lua_pcall(L, 2, 1, 0);
+  SPI_freetuptable(tuptable);
+  if (status != 0) return lua_error(L);
+  lua_pushinteger(L, nrows);
+  return 2;
+}
+
 /* ======= Cursor ======= */
 
 void luaP_pushcursor (lua_State *L, Portal cursor) {
@@ -747,6 +911,8 @@ void luaP_pushcursor (lua_State *L, Portal cursor) {
   c->cursor = cursor;
   c->rtupdesc = NULL;
   c->tupleQueue = NULL;
+  c->fetchsize = pllua_rows_fetch_size;
+  c->adaptive = true;
   c->resptr = register_resource(c, cursor_cleanup);
   luaP_getfield(L, PLLUA_CURSORMT);
   lua_setmetatable(L, -2);
@@ -777,6 +943,19 @@ static int luaP_cursorfetch (lua_State *L) {
   return 1;
 }
 
+static int luaP_cursorfetchcolumns (lua_State *L) {
+  luaP_Cursor *c = (luaP_Cursor *) luaP_checkudata(L, 1, PLLUA_CURSORMT);
+#if LUA_VERSION_NUM >= 503
+  long n = luaL_optinteger(L, 2, FETCH_ALL);
+#else
+  long n = luaL_optlong(L, 2, FETCH_ALL);
+#endif
+  PLLUA_PG_CATCH_RETHROW(
+    SPI_cursor_fetch(c->cursor, 1, n);
+  );
+  return luaP_pushcolumns(L);
+}
+
 static int luaP_cursormove (lua_State *L) {
   luaP_Cursor *c = (luaP_Cursor *) luaP_checkudata(L, 1, PLLUA_CURSORMT);
 #if LUA_VERSION_NUM >= 503
@@ -841,7 +1020,48 @@ static int luaP_plantostring (lua_State *L) {
 
 
 
-static int luaP_executeplan (lua_State *L) {
+/* converts plan arguments from table at pos, or from values at pos,
+ * pos + 1, ... if fromtable is not set */
+static void luaP_fillargs (lua_State *L, luaP_Plan *p, int pos,
+    bool fromtable) {
+  int i;
+  bool isnull;
+  if (fromtable) {
+    if (lua_type(L, pos) != LUA_TTABLE) luaP_typeerror(L, pos, "table");
+  }
+  else if (lua_gettop(L) < pos + p->nargs - 1) /* missing args are null */
+    lua_settop(L, pos + p->nargs - 1);
+  for (i = 0; i < p->nargs; i++) {
+    if (fromtable) {
+      lua_rawgeti(L, pos, i + 1);
+      p->values[i] = luaP_todatum(L, p->type[i], 0, &isnull, -1);
+      lua_pop(L, 1);
+    }
+    else
+      p->values[i] = luaP_todatum(L, p->type[i], 0, &isnull, pos + i);
+    p->nulls[i] = (isnull) ? 'n' : ' ';
+  }
+}
+
+#define luaP_returnsrows(result) \
+  ((result) == SPI_OK_SELECT \
+   || (result) == SPI_OK_UPDATE_RETURNING \
+   || (result) == SPI_OK_INSERT_RETURNING \
+   || (result) == SPI_OK_DELETE_RETURNING)
+
+/* executes plan with arguments in its buffers; returns SPI result */
+static int luaP_runplan (lua_State *L, luaP_Plan *p, bool ro, long c) {
+  int result = -1;
+  PLLUA_PG_CATCH_RETHROW(
+    result = SPI_execute_plan(p->plan, p->values, p->nulls, ro, c);
+  );
+  if (result < 0)
+    return luaL_error(L, "SPI_execute_plan error: %d", result);
+  return result;
+}
+
+/* plan:method(args, readonly [, count]); returns SPI result */
+static int luaP_doexecuteplan (lua_State *L) {
   luaP_Plan *p = (luaP_Plan *) luaP_checkudata(L, 1, PLLUA_PLANMT);
   bool ro = (bool) lua_toboolean(L, 3);
 #if LUA_VERSION_NUM >= 503
@@ -849,38 +1069,94 @@ static int luaP_executeplan (lua_State *L) {
 #else
   long c = luaL_optlong(L, 4, 0);
 #endif
-  int result = -1;
-  Datum *values = NULL;
-  char *nulls = NULL;
-
+  if (p->nargs > 0)
+    luaP_fillargs(L, p, 2, true);
+  return luaP_runplan(L, p, ro, c);
+}
 
-    if (p->nargs > 0) {
-        luaP_Buffer *b;
-        if (lua_type(L, 2) != LUA_TTABLE) luaP_typeerror(L, 2, "table");
-        b = luaP_getbuffer(L, p->nargs);
-        luaP_fillbuffer(L, 2, p->type, b);
-        values = b->value;
-        nulls = b->null;
+static int luaP_executeplan (lua_State *L) {
+  int result = luaP_doexecuteplan(L);
+  if (luaP_returnsrows(result) && SPI_processed > 0) /* any rows? */
+    luaP_pushtuptable(L, NULL);
+  else
+    lua_pushnil(L);
+  return 1;
+}
 
-    }
+/* plan:execute_v(readonly, count, ...) takes arguments as varargs */
+static int luaP_executevplan (lua_State *L) {
+  luaP_Plan *p = (luaP_Plan *) luaP_checkudata(L, 1, PLLUA_PLANMT);
+  bool ro = (bool) lua_toboolean(L, 2);
+#if LUA_VERSION_NUM >= 503
+  long c = luaL_optinteger(L, 3, 0);
+#else
+  long c = luaL_optlong(L, 3, 0);
+#endif
+  int result;
+  luaP_fillargs(L, p, 4, false);
+  result = luaP_runplan(L, p, ro, c);
+  if (luaP_returnsrows(result) && SPI_processed > 0) /* any rows? */
+    luaP_pushtuptable(L, NULL);
+  else
+    lua_pushnil(L);
+  return 1;
+}
 
+/* plan:execute_many(rows [, options]) executes plan for each argument table
+ * in array rows; returns total number of rows processed */
+static int luaP_executemanyplan (lua_State *L) {
+  luaP_Plan *p = (luaP_Plan *) luaP_checkudata(L, 1, PLLUA_PLANMT);
+  bool ro = false;
+  int n, i;
+  int result = 0;
+  uint64 processed = 0;
+  Datum *values;
+  char *nulls;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "ro");
+    ro = (bool) lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  n = (int) lua_rawlen(L, 2);
+  /* convert all arguments first: no Lua errors inside the catch frame;
+   * scratch arrays live in a userdata, so they are collected on errors */
+  values = (Datum *) lua_newuserdata(L,
+      n * p->nargs * (sizeof(Datum) + sizeof(char)));
+  nulls = (char *) (values + n * p->nargs);
+  for (i = 0; i < n && p->nargs > 0; i++) {
+    lua_rawgeti(L, 2, i + 1);
+    luaP_fillargs(L, p, lua_gettop(L), true);
+    memcpy(values + i * p->nargs, p->values, p->nargs * sizeof(Datum));
+    memcpy(nulls + i * p->nargs, p->nulls, p->nargs * sizeof(char));
+    lua_pop(L, 1);
+  }
   PLLUA_PG_CATCH_RETHROW(
-    result = SPI_execute_plan(p->plan, values, nulls, ro, c);
+    for (i = 0; i < n; i++) {
+      result = SPI_execute_plan(p->plan, values + i * p->nargs,
+          nulls + i * p->nargs, ro, 0);
+      if (result < 0) break;
+      processed += SPI_processed;
+      SPI_freetuptable(SPI_tuptable); /* results are not returned */
+    }
   );
-
+  lua_pop(L, 1); /* scratch arrays */
   if (result < 0)
     return luaL_error(L, "SPI_execute_plan error: %d", result);
-  if (((result == SPI_OK_SELECT)
-       ||(result == SPI_OK_UPDATE_RETURNING)
-       ||(result == SPI_OK_INSERT_RETURNING)
-       ||(result == SPI_OK_DELETE_RETURNING)
-       )&& SPI_processed > 0) /* any rows? */
-    luaP_pushtuptable(L, NULL);
-  else
-    lua_pushnil(L);
+  lua_pushnumber(L, (lua_Number) processed);
   return 1;
 }
 
+static int luaP_executecolumnsplan (lua_State *L) {
+  int result = luaP_doexecuteplan(L);
+  if (!luaP_returnsrows(result)) {
+    lua_pushnil(L);
+    return 1;
+  }
+  return luaP_pushcolumns(L);
+}
+
 static int luaP_saveplan (lua_State *L) {
   luaP_Plan *p = (luaP_Plan *) luaP_checkudata(L, 1, PLLUA_PLANMT);
   PLLUA_PG_CATCH_RETHROW(
@@ -907,19 +1183,11 @@ static int luaP_getcursorplan (lua_State *L) {
   bool ro = (bool) lua_toboolean(L, 3);
   const char *name = lua_tostring(L, 4);
   Portal cursor = NULL;
-  Datum *values = NULL;
-  char *nulls = NULL;
   if (SPI_is_cursor_plan(p->plan)) {
-    if (p->nargs > 0) {
-      luaP_Buffer *b;
-      if (lua_type(L, 2) != LUA_TTABLE) luaP_typeerror(L, 2, "table");
-      b = luaP_getbuffer(L, p->nargs);
-      luaP_fillbuffer(L, 2, p->type, b);
-      values = b->value;
-      nulls = b->null;
-    }
+    if (p->nargs > 0)
+      luaP_fillargs(L, p, 2, true);
     PLLUA_PG_CATCH_RETHROW(
-      cursor = SPI_cursor_open(name, p->plan, values, nulls, ro);
+      cursor = SPI_cursor_open(name, p->plan, p->values, p->nulls, ro);
     );
     if (cursor == NULL)
       return luaL_error(L, "error opening cursor");
@@ -929,30 +1197,51 @@ static int luaP_getcursorplan (lua_State *L) {
   return 1;
 }
 
+/* reads rows iterator options {batch = n} at idx; 0 if not given */
+static int luaP_getfetchsize (lua_State *L, int idx) {
+  lua_Integer n = 0;
+  if (lua_isnoneornil(L, idx)) return 0;
+  if (lua_type(L, idx) != LUA_TTABLE) luaP_typeerror(L, idx, "table");
+  lua_getfield(L, idx, "batch");
+  if (!lua_isnil(L, -1)) {
+    n = lua_tointeger(L, -1);
+    if (n < 1)
+      return luaL_error(L, "batch size must be a positive integer");
+    if (n > FETCH_BATCH_MAX)
+      return luaL_error(L, "batch size must not exceed %d", FETCH_BATCH_MAX);
+  }
+  lua_pop(L, 1);
+  return (int) n;
+}
+
+/* rows iterator over cursor; fetchsize 0 means adaptive from GUC */
+static void luaP_pushrows (lua_State *L, Portal cursor, int fetchsize) {
+  luaP_Cursor *c;
+  luaP_pushcursor(L, cursor);
+  c = (luaP_Cursor *) lua_touserdata(L, -1);
+  if (fetchsize > 0) {
+    c->fetchsize = fetchsize;
+    c->adaptive = false;
+  }
+  lua_pushboolean(L, 0); /* not inited */
+  lua_pushcclosure(L, luaP_rowsaux, 2);
+}
+
 static int luaP_rowsplan (lua_State *L) {
   luaP_Plan *p = (luaP_Plan *) luaP_checkudata(L, 1, PLLUA_PLANMT);
   Portal cursor = NULL;
-  Datum *values = NULL;
-  char *nulls = NULL;
+  int fetchsize = luaP_getfetchsize(L, 3);
   if (!SPI_is_cursor_plan(p->plan))
     return luaL_error(L, "Plan is not iterable");
-  if (p->nargs > 0) {
-    luaP_Buffer *b;
-    if (lua_type(L, 2) != LUA_TTABLE) luaP_typeerror(L, 2, "table");
-    b = luaP_getbuffer(L, p->nargs);
-    luaP_fillbuffer(L, 2, p->type, b);
-    values = b->value;
-    nulls = b->null;
-  }
+  if (p->nargs > 0)
+    luaP_fillargs(L, p, 2, true);
   PLLUA_PG_CATCH_RETHROW(
-    cursor = SPI_cursor_open(NULL, p->plan, values, nulls, 1);
+    cursor = SPI_cursor_open(NULL, p->plan, p->values, p->nulls, 1);
   );
 
   if (cursor == NULL)
     return luaL_error(L, "error opening cursor");
-  luaP_pushcursor(L, cursor);
-  lua_pushboolean(L, 0); /* not inited */
-  lua_pushcclosure(L, luaP_rowsaux, 2);
+  luaP_pushrows(L, cursor, fetchsize);
   return 1;
 }
 
@@ -970,10 +1259,12 @@ static int luaP_prepare (lua_State *L) {
     }
     cursoropt = luaL_optinteger(L, 3, 0);
     (void)cursoropt;
-    p = (luaP_Plan *) lua_newuserdata(L,
-                                      sizeof(luaP_Plan) + nargs * sizeof(Oid));
+    p = (luaP_Plan *) lua_newuserdata(L, luaP_plansize(nargs));
     p->issaved = 0;
     p->nargs = nargs;
+    p->values = (Datum *) ((char *) p
+        + MAXALIGN(sizeof(luaP_Plan) + nargs * sizeof(Oid)));
+    p->nulls = (char *) (p->values + nargs);
     if (nargs > 0) { /* read types? */
         lua_pushnil(L);
         while (lua_next(L, 2)) {
@@ -998,17 +1289,178 @@ static int luaP_prepare (lua_State *L) {
     return 1;
 }
 
-static int luaP_execute (lua_State *L) {
-  int result = -1;
+/* ======= Plan cache ======= */
+
+static void luaP_unlinkplan (luaP_PlanCache *pc, luaP_CachedPlan *e) {
+  if (e->prev) e->prev->next = e->next;
+  else pc->head = e->next;
+  if (e->next) e->next->prev = e->prev;
+  else pc->tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void luaP_linkplan (luaP_PlanCache *pc, luaP_CachedPlan *e) {
+  e->prev = NULL;
+  e->next = pc->head;
+  if (pc->head) pc->head->prev = e;
+  else pc->tail = e;
+  pc->head = e;
+}
+
+static void luaP_freecachedplan (luaP_CachedPlan *e) {
+  SPI_freeplan(e->plan);
+  pfree(e->query);
+  pfree(e);
+}
+
+/* evicts least recently used entries not in use until there is room for
+ * a new one; lookup table is at top */
+static void luaP_evictplans (lua_State *L, luaP_PlanCache *pc) {
+  luaP_CachedPlan *e = pc->tail;
+  while (e != NULL && pc->count >= pllua_plan_cache_size) {
+    luaP_CachedPlan *prev = e->prev;
+    if (e->inuse == 0) {
+      lua_pushstring(L, e->query);
+      lua_pushnil(L);
+      lua_rawset(L, -3);
+      luaP_unlinkplan(pc, e);
+      luaP_freecachedplan(e);
+      pc->count--;
+    }
+    e = prev;
+  }
+}
+
+/* returns cached saved plan for query q, preparing it on a miss; returns
+ * NULL if the cache is disabled, q may hold several statements, which
+ * must be analyzed one at a time, or transition tables are registered:
+ * plans over them depend on the trigger relation, not on the query text */
+static luaP_CachedPlan *luaP_cachedplan (lua_State *L, const char *q) {
+  luaP_PlanCache *pc;
+  luaP_CachedPlan *e;
+  SPI_plan *p = NULL;
+  if (pllua_plan_cache_size <= 0 || luaP_hasqueryenv
+      || strchr(q, ';') != NULL)
+    return NULL;
+  luaP_getfield(L, PLLUA_PLANCACHE);
+  pc = (luaP_PlanCache *) lua_touserdata(L, -1);
+  lua_getuservalue(L, -1);
+  lua_getfield(L, -1, q);
+  e = (luaP_CachedPlan *) lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (e != NULL) { /* hit? */
+    pc->hits++;
+    luaP_unlinkplan(pc, e);
+    luaP_linkplan(pc, e);
+    lua_pop(L, 2); /* lookup table, cache */
+    return e;
+  }
+  pc->misses++;
   PLLUA_PG_CATCH_RETHROW(
-    result = SPI_execute(luaL_checkstring(L, 1),
-                         (bool) lua_toboolean(L, 2),
-#if LUA_VERSION_NUM >= 503
-                         luaL_optinteger(L, 3, 0));
+    p = SPI_prepare_cursor(q, 0, NULL, 0);
+    if (p != NULL) {
+#if PG_VERSION_NUM >= 90200
+      SPI_keepplan(p);
 #else
-                         luaL_optlong(L, 3, 0));
+      SPI_plan *saved = SPI_saveplan(p);
+      SPI_freeplan(p);
+      p = saved;
 #endif
+    }
   );
+  if (p == NULL)
+    luaL_error(L, "SPI_prepare error: %d", SPI_result);
+  luaP_evictplans(L, pc);
+  e = (luaP_CachedPlan *) MemoryContextAlloc(luaP_getmemctxt(L),
+      sizeof(luaP_CachedPlan));
+  e->plan = p;
+  e->query = MemoryContextStrdup(luaP_getmemctxt(L), q);
+  e->inuse = 0;
+  luaP_linkplan(pc, e);
+  pc->count++;
+  lua_pushstring(L, q);
+  lua_pushlightuserdata(L, (void *) e);
+  lua_rawset(L, -3);
+  lua_pop(L, 2); /* lookup table, cache */
+  return e;
+}
+
+static int luaP_plancachegc (lua_State *L) {
+  luaP_PlanCache *pc = (luaP_PlanCache *) lua_touserdata(L, 1);
+  while (pc->head != NULL) {
+    luaP_CachedPlan *e = pc->head;
+    luaP_unlinkplan(pc, e);
+    luaP_freecachedplan(e);
+  }
+  pc->count = 0;
+  return 0;
+}
+
+static void luaP_newplancache (lua_State *L) {
+  luaP_PlanCache *pc;
+  lua_pushlightuserdata(L, (void *) PLLUA_PLANCACHE);
+  pc = (luaP_PlanCache *) lua_newuserdata(L, sizeof(luaP_PlanCache));
+  pc->head = pc->tail = NULL;
+  pc->count = 0;
+  pc->hits = pc->misses = 0;
+  lua_newtable(L); /* lookup */
+  lua_setuservalue(L, -2);
+  lua_newtable(L); /* MT */
+  lua_pushcfunction(L, luaP_plancachegc);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+/* server.cachestats() returns plan cache counters */
+static int luaP_cachestats (lua_State *L) {
+  luaP_PlanCache *pc;
+  luaP_getfield(L, PLLUA_PLANCACHE);
+  pc = (luaP_PlanCache *) lua_touserdata(L, -1);
+  lua_createtable(L, 0, 4);
+  lua_pushnumber(L, (lua_Number) pc->hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, (lua_Number) pc->misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushinteger(L, pc->count);
+  lua_setfield(L, -2, "entries");
+  lua_pushinteger(L, pllua_plan_cache_size);
+  lua_setfield(L, -2, "size");
+  return 1;
+}
+
+
+static int luaP_execute (lua_State *L) {
+  const char *q = luaL_checkstring(L, 1);
+  bool ro = (bool) lua_toboolean(L, 2);
+#if LUA_VERSION_NUM >= 503
+  long c = luaL_optinteger(L, 3, 0);
+#else
+  long c = luaL_optlong(L, 3, 0);
+#endif
+  int result = -1;
+  luaP_CachedPlan *e = luaP_cachedplan(L, q);
+  if (e != NULL) {
+    e->inuse++;
+    PLLUA_PG_CATCH_RETHROW(
+      PG_TRY();
+      {
+        result = SPI_execute_plan(e->plan, NULL, NULL, ro, c);
+      }
+      PG_CATCH();
+      {
+        e->inuse--;
+        PG_RE_THROW();
+      }
+      PG_END_TRY();
+    );
+    e->inuse--;
+  }
+  else {
+    PLLUA_PG_CATCH_RETHROW(
+      result = SPI_execute(q, ro, c);
+    );
+  }
   if (result < 0)
     return luaL_error(L, "SPI_execute_plan error: %d", result);
   if (result == SPI_OK_SELECT && SPI_processed > 0) /* any rows? */
@@ -1026,30 +1478,80 @@ static int luaP_find (lua_State *L) {
   return 1;
 }
 
-static int luaP_rows (lua_State *L) {
-  Portal cursor;
-  PLLUA_PG_CATCH_RETHROW(
-      SPI_plan *p = SPI_prepare_cursor(luaL_checkstring(L, 1), 0, NULL, 0);
-      if (SPI_result < 0)
-        return luaL_error(L, "SPI_prepare error: %d", SPI_result);
-      if (!SPI_is_cursor_plan(p))
-        return luaL_error(L, "Statement is not iterable");
-      cursor = SPI_cursor_open(NULL, p, NULL, NULL, 1);
-      SPI_freeplan(p);
-      if (cursor == NULL)
-        return luaL_error(L, "error opening cursor");
-      luaP_pushcursor(L, cursor);
-      lua_pushboolean(L, 0); /* not inited */
-      lua_pushcclosure(L, luaP_rowsaux, 2);
-  );
+/* pushes rows iterator over query q; plan is cached if cache is set */
+static int luaP_openrows (lua_State *L, const char *q, int fetchsize,
+    bool cache) {
+  SPI_plan *p = NULL;
+  Portal cursor = NULL;
+  bool iterable = false;
+  luaP_CachedPlan *e = cache ? luaP_cachedplan(L, q) : NULL;
+  if (e != NULL) { /* portal keeps its own reference to the plan */
+    p = e->plan;
+    PLLUA_PG_CATCH_RETHROW(
+        iterable = SPI_is_cursor_plan(p);
+        if (iterable)
+          cursor = SPI_cursor_open(NULL, p, NULL, NULL, 1);
+    );
+  }
+  else {
+    PLLUA_PG_CATCH_RETHROW(
+        p = SPI_prepare_cursor(q, 0, NULL, 0);
+        if (p != NULL) {
+          iterable = SPI_is_cursor_plan(p);
+          if (iterable)
+            cursor = SPI_cursor_open(NULL, p, NULL, NULL, 1);
+          SPI_freeplan(p);
+        }
+    );
+  }
+  if (p == NULL)
+    return luaL_error(L, "SPI_prepare error: %d", SPI_result);
+  if (!iterable)
+    return luaL_error(L, "Statement is not iterable");
+  if (cursor == NULL)
+    return luaL_error(L, "error opening cursor");
+  luaP_pushrows(L, cursor, fetchsize);
   return 1;
 }
 
+static int luaP_rows (lua_State *L) {
+  const char *q = luaL_checkstring(L, 1);
+  return luaP_openrows(L, q, luaP_getfetchsize(L, 2), true);
+}
+
+
+/* ======= Transition tables ======= */
+
+/* t:rows([options]) iterates over transition table t like server.rows */
+static int luaP_transitionrows (lua_State *L) {
+  const char *name;
+  int fetchsize = luaP_getfetchsize(L, 2);
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_getfield(L, 1, "name");
+  name = lua_tostring(L, -1);
+  if (name == NULL)
+    return luaL_error(L, "transition table name expected");
+  lua_pushfstring(L, "select * from %s", quote_identifier(name));
+  return luaP_openrows(L, lua_tostring(L, -1), fetchsize, false);
+}
+
+/* transition table registered with SPI_register_trigger_data */
+void luaP_pushtransition (lua_State *L, const char *name) {
+  lua_createtable(L, 0, 1);
+  lua_pushstring(L, name);
+  lua_setfield(L, -2, "name");
+  luaP_getfield(L, PLLUA_TRANSITIONMT);
+  lua_setmetatable(L, -2);
+}
+
 
 /* ======= luaP_registerspi ======= */
 
 static const luaL_Reg luaP_Plan_funcs[] = {
   {"execute", luaP_executeplan},
+  {"execute_columns", luaP_executecolumnsplan},
+  {"execute_many", luaP_executemanyplan},
+  {"execute_v", luaP_executevplan},
   {"save", luaP_saveplan},
   {"issaved", luaP_issavedplan},
   {"getcursor", luaP_getcursorplan},
@@ -1059,6 +1561,7 @@ static const luaL_Reg luaP_Plan_funcs[] = {
 
 static const luaL_Reg luaP_Cursor_funcs[] = {
   {"fetch", luaP_cursorfetch},
+  {"fetch_columns", luaP_cursorfetchcolumns},
   {"move", luaP_cursormove},
 #if PG_VERSION_NUM >= 80300
   {"posfetch", luaP_cursorposfetch},
@@ -1068,11 +1571,17 @@ static const luaL_Reg luaP_Cursor_funcs[] = {
   {NULL, NULL}
 };
 
+static const luaL_Reg luaP_Transition_funcs[] = {
+  {"rows", luaP_transitionrows},
+  {NULL, NULL}
+};
+
 static const luaL_Reg luaP_SPI_funcs[] = {
   {"prepare", luaP_prepare},
   {"execute", luaP_execute},
   {"find", luaP_find},
   {"rows", luaP_rows},
+  {"cachestats", luaP_cachestats},
   {NULL, NULL}
 };
 
@@ -1139,6 +1648,14 @@ void luaP_registerspi (lua_State *L) {
   lua_setfield(L, -2, "__index");
   luaP_register(L, luaP_Plan_mt);
   lua_pop(L, 1);
+  /* transition table */
+  luaP_newmetatable(L, PLLUA_TRANSITIONMT);
+  lua_newtable(L);
+  luaP_register(L, luaP_Transition_funcs);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+  /* ad-hoc query plans */
+  luaP_newplancache(L);
   /* SPI */
   lua_newtable(L);
 #if PG_VERSION_NUM >= 80300
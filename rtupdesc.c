@@ -2,6 +2,38 @@
 
 static int obj_count = 0;
 
+static uint32 attname_hash(const char *name)
+{
+    uint32 h = 2166136261u; /* FNV-1a */
+    for (; *name; name++){
+        h ^= (unsigned char) *name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* builds name -> index map in current memory context */
+static void rtupdesc_buildmap(RTupDesc *rtupdesc)
+{
+    TupleDesc tupdesc = rtupdesc->tupdesc;
+    uint32 size = 8;
+    int i;
+    while (size < (uint32) tupdesc->natts * 2)
+        size <<= 1;
+    rtupdesc->attmap = (int16 *) palloc0(size * sizeof(int16));
+    rtupdesc->attmapmask = size - 1;
+    for (i = 0; i < tupdesc->natts; i++){
+        Form_pg_attribute att = TupleDescAttr(tupdesc, i);
+        uint32 h;
+        if (att->attisdropped)
+            continue;
+        h = attname_hash(NameStr(att->attname)) & rtupdesc->attmapmask;
+        while (rtupdesc->attmap[h] != 0)
+            h = (h + 1) & rtupdesc->attmapmask;
+        rtupdesc->attmap[h] = (int16) (i + 1);
+    }
+}
+
 RTupDesc *rtupdesc_ctor(lua_State *state, TupleDesc tupdesc)
 {
     void* p;
@@ -13,6 +45,7 @@ RTupDesc *rtupdesc_ctor(lua_State *state, TupleDesc tupdesc)
         rtupdesc = (RTupDesc*)p;
         rtupdesc->ref_count = 1;
         rtupdesc->tupdesc = CreateTupleDescCopy(tupdesc);
+        rtupdesc_buildmap(rtupdesc);
         obj_count += 1;
         rtupdesc->weakNodeStk = rtds_push_current(p);
     }
@@ -48,6 +81,8 @@ void rtupdesc_freedesc(RTupDesc *rtupdesc)
     if (rtupdesc && rtupdesc->tupdesc){
         FreeTupleDesc(rtupdesc->tupdesc);
         rtupdesc->tupdesc = NULL;
+        pfree(rtupdesc->attmap);
+        rtupdesc->attmap = NULL;
         obj_count -= 1;
     }
 }
@@ -57,6 +92,23 @@ TupleDesc rtupdesc_gettup(RTupDesc *rtupdesc)
     return (rtupdesc ? rtupdesc->tupdesc : NULL);
 }
 
+/* index of attribute name, or -1 if not found or desc is lost */
+int rtupdesc_attindex(RTupDesc *rtupdesc, const char *name)
+{
+    uint32 h;
+    if (rtupdesc == NULL || rtupdesc->tupdesc == NULL)
+        return -1;
+    h = attname_hash(name) & rtupdesc->attmapmask;
+    while (rtupdesc->attmap[h] != 0){
+        int i = rtupdesc->attmap[h] - 1;
+        if (strcmp(NameStr(TupleDescAttr(rtupdesc->tupdesc, i)->attname),
+                   name) == 0)
+            return i;
+        h = (h + 1) & rtupdesc->attmapmask;
+    }
+    return -1;
+}
+
 
 void rtupdesc_dtor(RTupDesc *rtupdesc)
 {
@@ -67,6 +119,8 @@ void rtupdesc_dtor(RTupDesc *rtupdesc)
         if (rtupdesc->tupdesc){
             FreeTupleDesc(rtupdesc->tupdesc);
             rtupdesc->tupdesc = NULL;
+            pfree(rtupdesc->attmap);
+            rtupdesc->attmap = NULL;
             obj_count -= 1;
         }
 
@@ -8,6 +8,8 @@ typedef struct _RTupDesc{
     int ref_count;
     RTDNodePtr weakNodeStk;
     TupleDesc tupdesc;
+    int16 *attmap; /* open addressing: attribute name -> index + 1 */
+    uint32 attmapmask;
 } RTupDesc;
 
 RTupDesc* rtupdesc_ctor(lua_State * state, TupleDesc tupdesc);
@@ -19,6 +21,8 @@ RTupDesc* rtupdesc_unref(RTupDesc* rtupdesc);
 
 TupleDesc rtupdesc_gettup(RTupDesc* rtupdesc);
 
+int rtupdesc_attindex(RTupDesc* rtupdesc, const char *name);
+
 void rtupdesc_freedesc(RTupDesc* rtupdesc);
 
 void rtupdesc_dtor(RTupDesc* rtupdesc);
@@ -3,3 +3,23 @@ RETURNS bigint AS $$
   return value - 1;
 $$ LANGUAGE pllua;
 select int64_minus_one(9223372036854775807);
+CREATE FUNCTION int64_sum(value bigint, n integer)
+RETURNS bigint AS $$
+  local s = value - value
+  for i = 1, n do s = s + value end
+  return s
+$$ LANGUAGE pllua;
+select int64_sum(4294967296, 1000);
+CREATE FUNCTION int64_max(a bigint, b bigint)
+RETURNS bigint AS $$
+  if a < b then return b end
+  return a
+$$ LANGUAGE pllua;
+select int64_max(-9223372036854775807, 9223372036854775807);
+CREATE FUNCTION int64_array_inc(a bigint[])
+RETURNS bigint[] AS $$
+  local r = {}
+  for i = 1, #a do r[i] = a[i] + 1 end
+  return r
+$$ LANGUAGE pllua;
+select int64_array_inc(array[9223372036854775806, -1, 4294967295]);
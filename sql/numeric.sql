@@ -0,0 +1,45 @@
+CREATE FUNCTION num_arith(a numeric, b numeric) RETURNS numeric AS $$
+  return (a + b) * 2 - 1
+$$ LANGUAGE pllua;
+SELECT num_arith(1.25, 0.5);
+CREATE FUNCTION num_cmp(a numeric, b numeric) RETURNS text AS $$
+  return tostring(a < b) .. ' ' .. tostring(a == numeric.new(a)) .. ' '
+    .. tostring(-a) .. ' ' .. tostring(a:round(1))
+$$ LANGUAGE pllua;
+SELECT num_cmp(2.25, 3);
+CREATE TYPE num_pair AS (x numeric(5,2), y numeric);
+CREATE FUNCTION num_pair() RETURNS num_pair AS $$
+  return {x = numeric.new('3.14159'), y = 1 / 4}
+$$ LANGUAGE pllua;
+SELECT * FROM num_pair();
+CREATE FUNCTION num_sum(a numeric[]) RETURNS numeric AS $$
+  local s = 0
+  for i = 1, #a do s = s + a[i] end
+  return s
+$$ LANGUAGE pllua;
+SELECT num_sum(array[1.5, 2.25, 3]);
+CREATE FUNCTION num_arr(n int4) RETURNS numeric[] AS $$
+  local t = {}
+  for i = 1, n do t[i] = numeric.new(i) * 0.5 end
+  return t
+$$ LANGUAGE pllua;
+SELECT num_arr(3);
+CREATE FUNCTION num_type(a numeric) RETURNS text AS $$
+  return type(a)
+$$ LANGUAGE pllua;
+SELECT num_type(1.5);
+SET pllua.numeric_as_double = on;
+SELECT num_type(1.5);
+SELECT num_arith(1.25, 0.5);
+RESET pllua.numeric_as_double;
+CREATE DOMAIN posnum AS numeric(4,1) CHECK (VALUE > 0);
+CREATE FUNCTION num_dom(a posnum) RETURNS posnum AS $$
+  info(type(a) .. ' ' .. tostring(a + 1))
+  return a - 1
+$$ LANGUAGE pllua;
+SELECT num_dom(2.25);
+SELECT num_dom(0.5);
+CREATE FUNCTION num_bad() RETURNS numeric AS $$
+  return fromstring('point', '(1,2)')
+$$ LANGUAGE pllua;
+SELECT num_bad();
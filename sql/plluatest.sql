@@ -271,6 +271,11 @@ SELECT echo_text('qwe''qwe');
 CREATE FUNCTION echo_bytea(arg bytea) RETURNS bytea AS $$ return arg $$ LANGUAGE pllua;
 SELECT echo_bytea('qwe''qwe');
 SELECT echo_bytea(E'q\\000w\\001e''q\\\\we');
+CREATE FUNCTION raw_bytea() RETURNS bytea AS $$ return fromstring('bytea', [[\x0102ff]]) $$ LANGUAGE pllua;
+SELECT raw_bytea();
+CREATE DOMAIN mytext AS text;
+CREATE FUNCTION echo_mytext(arg mytext) RETURNS text AS $$ return arg $$ LANGUAGE pllua;
+SELECT echo_mytext('domain text');
 CREATE FUNCTION echo_timestamptz(arg timestamptz) RETURNS timestamptz AS $$ return arg $$ LANGUAGE pllua;
 SELECT echo_timestamptz('2007-01-06 11:11 UTC') AT TIME ZONE 'UTC';
 CREATE FUNCTION echo_timestamp(arg timestamp) RETURNS timestamp AS $$ return arg $$ LANGUAGE pllua;
@@ -320,6 +325,29 @@ $$ LANGUAGE pllua;
 
 select quote_nullable(pg_temp.srf());
 
+CREATE FUNCTION srf_count(n int4) RETURNS SETOF int4 AS $$
+  for i = 1, n do
+    info('yield ' .. i)
+    coroutine.yield(i)
+  end
+$$ LANGUAGE pllua;
+SELECT * FROM srf_count(4) LIMIT 2;
+CREATE FUNCTION srf_nulls() RETURNS SETOF text AS $$
+  coroutine.yield('a')
+  coroutine.yield(nil)
+  coroutine.yield('c')
+$$ LANGUAGE pllua;
+SELECT x IS NULL AS isnull, x FROM srf_nulls() AS x LIMIT 2;
+SELECT srf_nulls() LIMIT 2;
+SELECT srf_nulls();
+CREATE TYPE srf_pair AS (a int4, b text);
+CREATE FUNCTION srf_pairs() RETURNS SETOF srf_pair AS $$
+  coroutine.yield({a = 1, b = 'one'})
+  coroutine.yield(nil)
+  coroutine.yield({a = 3})
+$$ LANGUAGE pllua;
+SELECT * FROM srf_pairs();
+
 CREATE or replace FUNCTION pg_temp.inoutf(a integer, INOUT b text, INOUT c text)  AS
 $$
 begin
@@ -343,3 +371,56 @@ RETURNS text AS $$
   return string.format("Bye, %s!", name)
 $$ LANGUAGE pllua;
 SELECT hello('PostgreSQL');
+
+-- rows outlive their tuple table and trigger call
+CREATE TABLE kept_rows (id int4, name text);
+CREATE FUNCTION kept_rows_trg() RETURNS trigger AS $$
+  setshared('kept_row', trigger.row)
+$$ LANGUAGE pllua;
+CREATE TRIGGER kept_rows_trg BEFORE INSERT ON kept_rows
+  FOR EACH ROW EXECUTE PROCEDURE kept_rows_trg();
+INSERT INTO kept_rows VALUES (7, 'seven');
+do $$
+local r = server.execute("select 1 as a, 'x'::text as b", true)[1]
+collectgarbage()
+print(r.a .. r.b)
+print(kept_row.id)
+$$ language pllua;
+
+-- array views
+CREATE FUNCTION view_info(a int4[]) RETURNS text AS $$
+  local t = {}
+  for i, v in a:ipairs() do t[#t + 1] = i .. '=' .. tostring(v) end
+  return table.concat({#a, tostring(a[0]), tostring(a[2]),
+    table.concat(t, ','), tostring(a)}, ' ')
+$$ LANGUAGE pllua SET pllua.array_views = on;
+SELECT view_info('{1,NULL,3}');
+SELECT view_info('[0:2]={10,20,30}');
+CREATE FUNCTION view_slice(a text[], i int4, j int4) RETURNS text AS $$
+  local t, s = a:slice(i, j), {}
+  for k = 1, j - i + 1 do s[k] = tostring(t[k]) end
+  return table.concat(s, ',')
+$$ LANGUAGE pllua SET pllua.array_views = on;
+SELECT view_slice('{a,NULL,c,d}', 2, 3);
+SELECT view_slice('[0:3]={a,b,c,d}', -1, 1);
+CREATE FUNCTION view_echo(a text[]) RETURNS text[] AS $$
+  return a
+$$ LANGUAGE pllua SET pllua.array_views = on;
+CREATE FUNCTION view_badecho(a text[]) RETURNS int4[] AS $$
+  return a
+$$ LANGUAGE pllua SET pllua.array_views = on;
+SELECT view_echo('[0:2]={a,NULL,c}');
+SELECT view_badecho('{a}');
+
+-- trigger table fields do not outlive the call
+CREATE TABLE trg_fields (id int4);
+CREATE FUNCTION trg_fields_trg() RETURNS trigger AS $$
+  print(tostring(trigger.mark) .. ' ' ..
+    tostring(trigger.relation.attributes.name))
+  trigger.mark = trigger.row.id
+$$ LANGUAGE pllua;
+CREATE TRIGGER trg_fields_trg BEFORE INSERT ON trg_fields
+  FOR EACH ROW EXECUTE PROCEDURE trg_fields_trg();
+INSERT INTO trg_fields VALUES (1), (2);
+ALTER TABLE trg_fields ADD COLUMN name text;
+INSERT INTO trg_fields VALUES (3);
@@ -0,0 +1,59 @@
+CREATE TABLE stream_t (id int4, doc text, bin bytea);
+ALTER TABLE stream_t ALTER COLUMN doc SET STORAGE EXTERNAL;
+ALTER TABLE stream_t ALTER COLUMN bin SET STORAGE EXTERNAL;
+INSERT INTO stream_t VALUES
+  (1, repeat('abcdefghij', 500), decode(repeat('00ff', 2500), 'hex')),
+  (2, 'short', '\x0102');
+SET pllua.stream_threshold = 1;
+CREATE FUNCTION stream_info(doc text) RETURNS text AS $$
+  if type(doc) == "string" then return "string " .. #doc end
+  local head = doc:read(4)
+  local pos = doc:seek()
+  doc:seek(4995)
+  local tail = doc:read()
+  local done = doc:read()
+  local n, count = 0, 0
+  doc:seek(0)
+  for c in doc:chunks(1000) do n = n + #c; count = count + 1 end
+  return table.concat({#doc, head, pos, tail, tostring(done), n, count,
+    #tostring(doc)}, ' ')
+$$ LANGUAGE pllua;
+SELECT id, stream_info(doc) FROM stream_t ORDER BY id;
+CREATE FUNCTION stream_echo(doc text) RETURNS text AS $$
+  return doc
+$$ LANGUAGE pllua;
+SELECT id, length(stream_echo(doc)), stream_echo(doc) = doc AS same
+  FROM stream_t ORDER BY id;
+CREATE FUNCTION stream_copy(bin bytea) RETURNS bytea AS $$
+  if type(bin) == "string" then return bin end
+  local w = writer(16)
+  for c in bin:chunks(1000) do w:write(c) end
+  return w
+$$ LANGUAGE pllua;
+SELECT id, length(stream_copy(bin)), stream_copy(bin) = bin AS same
+  FROM stream_t ORDER BY id;
+CREATE FUNCTION writer_text(n int4) RETURNS text AS $$
+  local w = writer(4)
+  for i = 1, n do w:write(i, ',') end
+  info(#w)
+  return w:write('end')
+$$ LANGUAGE pllua;
+SELECT writer_text(5);
+CREATE FUNCTION stream_keep(doc text) RETURNS int4 AS $$
+  setshared('kept_stream', doc)
+  return #doc
+$$ LANGUAGE pllua;
+SELECT stream_keep(doc) FROM stream_t WHERE id = 1;
+CREATE FUNCTION stream_kept() RETURNS text AS $$
+  local ok, err = pcall(kept_stream.read, kept_stream, 3)
+  return tostring(ok) .. ' ' .. tostring(err)
+$$ LANGUAGE pllua;
+SELECT stream_kept();
+CREATE FUNCTION stream_badargs(doc text) RETURNS text AS $$
+  local f = doc:chunks()
+  local mt = getmetatable(doc)
+  return tostring((pcall(f, nil))) .. ' ' ..
+    tostring((pcall(mt.__tostring, {})))
+$$ LANGUAGE pllua;
+SELECT stream_badargs(doc) FROM stream_t WHERE id = 1;
+RESET pllua.stream_threshold;
@@ -0,0 +1,46 @@
+CREATE TABLE trans_a (id int4, label text);
+CREATE TABLE trans_b (amount float8);
+CREATE FUNCTION trans_show() RETURNS trigger AS $$
+  local rel = trigger.relation.name
+  for r in server.rows('select * from new_rows') do
+    if rel == 'trans_a' then
+      info(rel .. ' ' .. r.id .. ' ' .. r.label)
+    else
+      info(rel .. ' ' .. r.amount)
+    end
+  end
+  for r in trigger.new_table:rows() do
+    info(trigger.new_table.name .. ' ' .. tostring(r.id or r.amount))
+  end
+$$ LANGUAGE pllua;
+CREATE TRIGGER trans_a_ins AFTER INSERT ON trans_a
+  REFERENCING NEW TABLE AS new_rows
+  FOR EACH STATEMENT EXECUTE PROCEDURE trans_show();
+CREATE TRIGGER trans_b_ins AFTER INSERT ON trans_b
+  REFERENCING NEW TABLE AS new_rows
+  FOR EACH STATEMENT EXECUTE PROCEDURE trans_show();
+INSERT INTO trans_a VALUES (1, 'one'), (2, 'two');
+INSERT INTO trans_b VALUES (2.5);
+INSERT INTO trans_a VALUES (3, 'three');
+ALTER TABLE trans_b ADD COLUMN note text;
+INSERT INTO trans_b VALUES (4.5, 'note');
+CREATE FUNCTION trans_diff() RETURNS trigger AS $$
+  local old, new = 0, 0
+  for r in trigger.old_table:rows() do old = old + r.id end
+  for r in trigger.new_table:rows({batch = 1}) do new = new + r.id end
+  info(trigger.operation .. ' ' .. trigger.old_table.name .. ' ' .. old
+    .. ' ' .. trigger.new_table.name .. ' ' .. new)
+$$ LANGUAGE pllua;
+CREATE TRIGGER trans_a_upd AFTER UPDATE ON trans_a
+  REFERENCING OLD TABLE AS before_rows NEW TABLE AS after_rows
+  FOR EACH STATEMENT EXECUTE PROCEDURE trans_diff();
+UPDATE trans_a SET id = id * 10;
+CREATE FUNCTION trans_deleted() RETURNS trigger AS $$
+  info(tostring(trigger.new_table))
+  local n = server.execute('select count(*)::int4 as n from gone', true)[1].n
+  info('deleted ' .. tostring(n))
+$$ LANGUAGE pllua;
+CREATE TRIGGER trans_a_del AFTER DELETE ON trans_a
+  REFERENCING OLD TABLE AS gone
+  FOR EACH STATEMENT EXECUTE PROCEDURE trans_deleted();
+DELETE FROM trans_a WHERE id > 10;